@@ -0,0 +1,404 @@
+/* chacha.c: ChaCha20 keystream generator
+ *
+ * D. J. Bernstein's ChaCha with 20 rounds and a 256-bit key. The last four
+ * words of the input block hold a 128-bit block counter, least significant
+ * word first, so the whole of the PRNG's counter space maps onto distinct
+ * blocks. With the key and counter set accordingly the output matches the
+ * test vectors of RFC 7539.
+ *
+ * The keystream is the same on every backend. The SIMD backends compute
+ * four (SSE2) or eight (AVX2) blocks side by side, one block per lane, and
+ * are selected at run time like the AES-NI code in umac.c.
+ */
+
+#include "umac.h"       /* UINT32 */
+#include "chacha.h"
+
+#if ((__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9) || __clang__) \
+     && (__x86_64__ || __i386__))
+#define GCC_CHACHA_SIMD 1
+#else
+#define GCC_CHACHA_SIMD 0
+#endif
+
+#define ROTL32(v, n)    (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define LOAD32_LE(p)    ((UINT32)(p)[0] | ((UINT32)(p)[1] << 8) | \
+                         ((UINT32)(p)[2] << 16) | ((UINT32)(p)[3] << 24))
+
+#define STORE32_LE(p, v)  do {                          \
+                            (p)[0] = (UINT8)(v);        \
+                            (p)[1] = (UINT8)((v) >> 8); \
+                            (p)[2] = (UINT8)((v) >> 16);\
+                            (p)[3] = (UINT8)((v) >> 24);\
+                          } while (0)
+
+#define QUARTERROUND(a, b, c, d)                        \
+  a += b; d ^= a; d = ROTL32(d, 16);                    \
+  c += d; b ^= c; b = ROTL32(b, 12);                    \
+  a += b; d ^= a; d = ROTL32(d, 8);                     \
+  c += d; b ^= c; b = ROTL32(b, 7)
+
+/* Constants and key; words 12 to 15 are filled in per block */
+static void
+chacha_input(UINT8 key[CHACHA_KEY_LEN], UINT32 in[16])
+{
+  int i;
+
+  in[0] = 0x61707865;
+  in[1] = 0x3320646e;
+  in[2] = 0x79622d32;
+  in[3] = 0x6b206574;
+  for (i = 0; i < 8; i++)
+  {
+    in[4 + i] = LOAD32_LE(&key[4 * i]);
+  }
+}
+
+/* Counters after hi:lo, split into the four counter words of each block */
+static void
+chacha_counters(uint64 *hi, uint64 *lo, UINT32 *w12, UINT32 *w13,
+                UINT32 *w14, UINT32 *w15, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+  {
+    if (++(*lo) == 0)
+    {
+      ++(*hi);
+    }
+    w12[i] = (UINT32)*lo;
+    w13[i] = (UINT32)(*lo >> 32);
+    w14[i] = (UINT32)*hi;
+    w15[i] = (UINT32)(*hi >> 32);
+  }
+}
+
+static void
+chacha_blocks_scalar(UINT8 key[CHACHA_KEY_LEN], uint64 ctr[2], UINT8 *out,
+                     int nblocks)
+{
+  UINT32 in[16], x[16];
+  uint64 hi, lo;
+  int i;
+
+  chacha_input(key, in);
+  hi = long_long_swap(ctr[0]);
+  lo = long_long_swap(ctr[1]);
+
+  for (; nblocks > 0; nblocks--, out += CHACHA_BLOCK_LEN)
+  {
+    chacha_counters(&hi, &lo, &in[12], &in[13], &in[14], &in[15], 1);
+    memcpy(x, in, sizeof(x));
+    for (i = 0; i < 10; i++)
+    {
+      QUARTERROUND(x[0], x[4], x[8], x[12]);
+      QUARTERROUND(x[1], x[5], x[9], x[13]);
+      QUARTERROUND(x[2], x[6], x[10], x[14]);
+      QUARTERROUND(x[3], x[7], x[11], x[15]);
+      QUARTERROUND(x[0], x[5], x[10], x[15]);
+      QUARTERROUND(x[1], x[6], x[11], x[12]);
+      QUARTERROUND(x[2], x[7], x[8], x[13]);
+      QUARTERROUND(x[3], x[4], x[9], x[14]);
+    }
+    for (i = 0; i < 16; i++)
+    {
+      x[i] += in[i];
+      STORE32_LE(&out[4 * i], x[i]);
+    }
+  }
+
+  ctr[0] = long_long_swap(hi);
+  ctr[1] = long_long_swap(lo);
+  memset(in, 0, sizeof(in));
+  memset(x, 0, sizeof(x));
+}
+
+#if (GCC_CHACHA_SIMD)
+
+#include <immintrin.h>
+
+/* Both SIMD backends keep word i of every block in vector x[i] and run the
+ * scalar rounds on whole vectors. x86 is little endian, so the words of a
+ * block go to memory as they are once the lanes are transposed back.
+ */
+
+#define SSE2_TARGET __attribute__((target("sse2")))
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+#define SSE2_ROTL(v, n) \
+  _mm_or_si128(_mm_slli_epi32((v), (n)), _mm_srli_epi32((v), 32 - (n)))
+
+#define SSE2_QR(a, b, c, d)                                             \
+  a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = SSE2_ROTL(d, 16); \
+  c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = SSE2_ROTL(b, 12); \
+  a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = SSE2_ROTL(d, 8);  \
+  c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = SSE2_ROTL(b, 7)
+
+SSE2_TARGET
+static void
+chacha_blocks_sse2(UINT8 key[CHACHA_KEY_LEN], uint64 ctr[2], UINT8 *out,
+                   int nblocks)
+{
+  UINT32 in[16], w[4][4];
+  __m128i x[16], t0, t1, t2, t3;
+  uint64 hi, lo;
+  int i, g;
+
+  chacha_input(key, in);
+  hi = long_long_swap(ctr[0]);
+  lo = long_long_swap(ctr[1]);
+
+  for (; nblocks >= 4; nblocks -= 4, out += 4 * CHACHA_BLOCK_LEN)
+  {
+    chacha_counters(&hi, &lo, w[0], w[1], w[2], w[3], 4);
+    for (i = 0; i < 12; i++)
+    {
+      x[i] = _mm_set1_epi32((int)in[i]);
+    }
+    for (i = 0; i < 4; i++)
+    {
+      x[12 + i] = _mm_loadu_si128((__m128i *)w[i]);
+    }
+
+    for (i = 0; i < 10; i++)
+    {
+      SSE2_QR(x[0], x[4], x[8], x[12]);
+      SSE2_QR(x[1], x[5], x[9], x[13]);
+      SSE2_QR(x[2], x[6], x[10], x[14]);
+      SSE2_QR(x[3], x[7], x[11], x[15]);
+      SSE2_QR(x[0], x[5], x[10], x[15]);
+      SSE2_QR(x[1], x[6], x[11], x[12]);
+      SSE2_QR(x[2], x[7], x[8], x[13]);
+      SSE2_QR(x[3], x[4], x[9], x[14]);
+    }
+
+    for (i = 0; i < 12; i++)
+    {
+      x[i] = _mm_add_epi32(x[i], _mm_set1_epi32((int)in[i]));
+    }
+    for (i = 0; i < 4; i++)
+    {
+      x[12 + i] = _mm_add_epi32(x[12 + i],
+                                _mm_loadu_si128((__m128i *)w[i]));
+    }
+
+    /* Transpose each group of four words into the four blocks */
+    for (g = 0; g < 4; g++)
+    {
+      t0 = _mm_unpacklo_epi32(x[4 * g], x[4 * g + 1]);
+      t1 = _mm_unpacklo_epi32(x[4 * g + 2], x[4 * g + 3]);
+      t2 = _mm_unpackhi_epi32(x[4 * g], x[4 * g + 1]);
+      t3 = _mm_unpackhi_epi32(x[4 * g + 2], x[4 * g + 3]);
+      _mm_storeu_si128((__m128i *)(out + 16 * g),
+                       _mm_unpacklo_epi64(t0, t1));
+      _mm_storeu_si128((__m128i *)(out + 64 + 16 * g),
+                       _mm_unpackhi_epi64(t0, t1));
+      _mm_storeu_si128((__m128i *)(out + 128 + 16 * g),
+                       _mm_unpacklo_epi64(t2, t3));
+      _mm_storeu_si128((__m128i *)(out + 192 + 16 * g),
+                       _mm_unpackhi_epi64(t2, t3));
+    }
+  }
+
+  ctr[0] = long_long_swap(hi);
+  ctr[1] = long_long_swap(lo);
+  memset(in, 0, sizeof(in));
+  memset(x, 0, sizeof(x));
+  if (nblocks > 0)
+  {
+    chacha_blocks_scalar(key, ctr, out, nblocks);
+  }
+}
+
+#define AVX2_ROTL(v, n) \
+  _mm256_or_si256(_mm256_slli_epi32((v), (n)), _mm256_srli_epi32((v), 32 - (n)))
+
+/* Rotations by whole bytes are a single byte shuffle */
+#define AVX2_ROTL16(v)  _mm256_shuffle_epi8((v), rot16)
+#define AVX2_ROTL8(v)   _mm256_shuffle_epi8((v), rot8)
+
+#define AVX2_QR(a, b, c, d)                                                   \
+  a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a); d = AVX2_ROTL16(d); \
+  c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); b = AVX2_ROTL(b, 12); \
+  a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a); d = AVX2_ROTL8(d);  \
+  c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); b = AVX2_ROTL(b, 7)
+
+AVX2_TARGET
+static void
+chacha_blocks_avx2(UINT8 key[CHACHA_KEY_LEN], uint64 ctr[2], UINT8 *out,
+                   int nblocks)
+{
+  UINT32 in[16], w[4][8];
+  __m256i x[16], t0, t1, t2, t3, b0, b1, b2, b3;
+  __m256i rot16, rot8;
+  uint64 hi, lo;
+  int i, g;
+
+  rot16 = _mm256_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+                           2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+  rot8 = _mm256_setr_epi8(3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14,
+                          3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14);
+
+  chacha_input(key, in);
+  hi = long_long_swap(ctr[0]);
+  lo = long_long_swap(ctr[1]);
+
+  for (; nblocks >= 8; nblocks -= 8, out += 8 * CHACHA_BLOCK_LEN)
+  {
+    chacha_counters(&hi, &lo, w[0], w[1], w[2], w[3], 8);
+    for (i = 0; i < 12; i++)
+    {
+      x[i] = _mm256_set1_epi32((int)in[i]);
+    }
+    for (i = 0; i < 4; i++)
+    {
+      x[12 + i] = _mm256_loadu_si256((__m256i *)w[i]);
+    }
+
+    for (i = 0; i < 10; i++)
+    {
+      AVX2_QR(x[0], x[4], x[8], x[12]);
+      AVX2_QR(x[1], x[5], x[9], x[13]);
+      AVX2_QR(x[2], x[6], x[10], x[14]);
+      AVX2_QR(x[3], x[7], x[11], x[15]);
+      AVX2_QR(x[0], x[5], x[10], x[15]);
+      AVX2_QR(x[1], x[6], x[11], x[12]);
+      AVX2_QR(x[2], x[7], x[8], x[13]);
+      AVX2_QR(x[3], x[4], x[9], x[14]);
+    }
+
+    for (i = 0; i < 12; i++)
+    {
+      x[i] = _mm256_add_epi32(x[i], _mm256_set1_epi32((int)in[i]));
+    }
+    for (i = 0; i < 4; i++)
+    {
+      x[12 + i] = _mm256_add_epi32(x[12 + i],
+                                   _mm256_loadu_si256((__m256i *)w[i]));
+    }
+
+    /* The unpacks work within 128-bit lanes, so each transposed vector
+     * holds a group of four words for block k in its low half and for
+     * block k + 4 in its high half.
+     */
+    for (g = 0; g < 4; g++)
+    {
+      t0 = _mm256_unpacklo_epi32(x[4 * g], x[4 * g + 1]);
+      t1 = _mm256_unpacklo_epi32(x[4 * g + 2], x[4 * g + 3]);
+      t2 = _mm256_unpackhi_epi32(x[4 * g], x[4 * g + 1]);
+      t3 = _mm256_unpackhi_epi32(x[4 * g + 2], x[4 * g + 3]);
+      b0 = _mm256_unpacklo_epi64(t0, t1);
+      b1 = _mm256_unpackhi_epi64(t0, t1);
+      b2 = _mm256_unpacklo_epi64(t2, t3);
+      b3 = _mm256_unpackhi_epi64(t2, t3);
+      _mm_storeu_si128((__m128i *)(out + 16 * g),
+                       _mm256_castsi256_si128(b0));
+      _mm_storeu_si128((__m128i *)(out + 64 + 16 * g),
+                       _mm256_castsi256_si128(b1));
+      _mm_storeu_si128((__m128i *)(out + 128 + 16 * g),
+                       _mm256_castsi256_si128(b2));
+      _mm_storeu_si128((__m128i *)(out + 192 + 16 * g),
+                       _mm256_castsi256_si128(b3));
+      _mm_storeu_si128((__m128i *)(out + 256 + 16 * g),
+                       _mm256_extracti128_si256(b0, 1));
+      _mm_storeu_si128((__m128i *)(out + 320 + 16 * g),
+                       _mm256_extracti128_si256(b1, 1));
+      _mm_storeu_si128((__m128i *)(out + 384 + 16 * g),
+                       _mm256_extracti128_si256(b2, 1));
+      _mm_storeu_si128((__m128i *)(out + 448 + 16 * g),
+                       _mm256_extracti128_si256(b3, 1));
+    }
+  }
+
+  ctr[0] = long_long_swap(hi);
+  ctr[1] = long_long_swap(lo);
+  memset(in, 0, sizeof(in));
+  memset(x, 0, sizeof(x));
+  if (nblocks > 0)
+  {
+    chacha_blocks_sse2(key, ctr, out, nblocks);
+  }
+}
+
+static int
+sse2_supported(void)
+{
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("sse2");
+}
+
+static int
+avx2_supported(void)
+{
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}
+
+#endif /* GCC_CHACHA_SIMD */
+
+/* The first call probes the CPU and installs the best backend */
+static void chacha_blocks_probe(UINT8 *key, uint64 *ctr, UINT8 *out,
+                                int nblocks);
+
+static void (*chacha_blocks_impl)(UINT8 *, uint64 *, UINT8 *, int) =
+  chacha_blocks_probe;
+
+int
+chacha_set_backend(int backend)
+{
+#if (GCC_CHACHA_SIMD)
+  if (backend == CHACHA_BACKEND_AUTO)
+  {
+    backend = (avx2_supported() ? CHACHA_BACKEND_AVX2 :
+               sse2_supported() ? CHACHA_BACKEND_SSE2 : CHACHA_BACKEND_SCALAR);
+  }
+  if (backend == CHACHA_BACKEND_AVX2 && avx2_supported())
+  {
+    chacha_blocks_impl = chacha_blocks_avx2;
+    return CHACHA_BACKEND_AVX2;
+  }
+  if (backend == CHACHA_BACKEND_SSE2 && sse2_supported())
+  {
+    chacha_blocks_impl = chacha_blocks_sse2;
+    return CHACHA_BACKEND_SSE2;
+  }
+#endif
+  chacha_blocks_impl = chacha_blocks_scalar;
+  return CHACHA_BACKEND_SCALAR;
+}
+
+int
+chacha_get_backend(void)
+{
+  if (chacha_blocks_impl == chacha_blocks_probe)
+  {
+    chacha_set_backend(CHACHA_BACKEND_AUTO);
+  }
+#if (GCC_CHACHA_SIMD)
+  if (chacha_blocks_impl == chacha_blocks_avx2)
+  {
+    return CHACHA_BACKEND_AVX2;
+  }
+  if (chacha_blocks_impl == chacha_blocks_sse2)
+  {
+    return CHACHA_BACKEND_SSE2;
+  }
+#endif
+  return CHACHA_BACKEND_SCALAR;
+}
+
+static void
+chacha_blocks_probe(UINT8 *key, uint64 *ctr, UINT8 *out, int nblocks)
+{
+  chacha_set_backend(CHACHA_BACKEND_AUTO);
+  chacha_blocks_impl(key, ctr, out, nblocks);
+}
+
+void
+chacha_blocks(UINT8 key[CHACHA_KEY_LEN], uint64 ctr[2], UINT8 *out,
+              int nblocks)
+{
+  chacha_blocks_impl(key, ctr, out, nblocks);
+}
@@ -0,0 +1,38 @@
+#ifndef _CHACHA_H_
+#define _CHACHA_H_ 1
+
+#include "platform.h"
+
+/* chacha.h: ChaCha20 keystream generator for the PRNG */
+
+/* CHACHA_KEY_LEN and CHACHA_BLOCK_LEN are in egads.h */
+
+#define CHACHA_BACKEND_AUTO     0   /* Best backend the CPU supports */
+#define CHACHA_BACKEND_SCALAR   1   /* Portable C */
+#define CHACHA_BACKEND_SSE2     2   /* x86 SSE2, four blocks at a time */
+#define CHACHA_BACKEND_AVX2     3   /* x86 AVX2, eight blocks at a time */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Write nblocks blocks of ChaCha20 keystream under key to out. The 128-bit
+ * block counter is held in ctr in the layout of prngctx_t.ectr, most
+ * significant word first; the blocks use the counters after ctr, which is
+ * left at the last of them. out needs no particular alignment.
+ */
+void chacha_blocks(UINT8 key[CHACHA_KEY_LEN], uint64 ctr[2], UINT8 *out,
+                   int nblocks);
+
+/* Select the implementation used by chacha_blocks(). Every backend
+ * produces the same keystream. Returns the backend now in use, which is
+ * CHACHA_BACKEND_SCALAR if the one asked for is not supported.
+ */
+int chacha_set_backend(int backend);
+int chacha_get_backend(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _CHACHA_H_ */
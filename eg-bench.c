@@ -0,0 +1,168 @@
+/* Throughput benchmark for the egads entropy pool.
+ *
+ * usage: eg-bench [seconds [reservoir bytes [copy|claim]]]
+ *
+ * EG_PRODUCERS threads add 16-byte samples as fast as they can, spread over
+ * every source, while EG_READERS threads read from the pool in blocking
+ * 16-byte requests, as the daemon's clients do. Readers copy the output out
+ * with EG_output(), or with "claim" take it in place with EG_output_claim()
+ * as the daemon does for socket writes. Reports samples added, bytes read
+ * and context switches per second.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <pthread.h>
+
+#include "eg.h"
+
+#define EG_PRODUCERS    8
+#define EG_READERS      64
+#define EG_READ_LEN     16
+
+static volatile int stop;
+static unsigned long added[EG_PRODUCERS], lost[EG_PRODUCERS];
+static unsigned long nread[EG_READERS];
+static int sources[NUM_SOURCES];
+static int claim;
+
+static double
+now(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Voluntary and involuntary context switches of the whole process */
+static void
+switches(long *vol, long *invol)
+{
+  struct rusage ru;
+
+  getrusage(RUSAGE_SELF, &ru);
+  *vol = ru.ru_nvcsw;
+  *invol = ru.ru_nivcsw;
+}
+
+static void *
+producer(void *arg)
+{
+  int id = (int)(long)arg;
+  unsigned char sample[16];
+  struct timeval tv;
+
+  while (!stop)
+  {
+    gettimeofday(&tv, NULL);
+    memcpy(sample, &tv, sizeof(sample) < sizeof(tv) ? sizeof(sample)
+                                                    : sizeof(tv));
+    sample[0] ^= (unsigned char)added[id];
+    if (EG_add_entropy(sources[id % NUM_SOURCES], sample, sizeof(sample), 8)
+        > 0)
+    {
+      added[id]++;
+    }
+    else
+    {
+      lost[id]++;
+    }
+  }
+  return NULL;
+}
+
+static void *
+reader(void *arg)
+{
+  int id = (int)(long)arg;
+  char buf[EG_READ_LEN];
+  eg_seg_t seg[2];
+  unsigned int ticket;
+  int n;
+
+  pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
+  for (;;)
+  {
+    if (!claim)
+    {
+      nread[id] += EG_output(buf, sizeof(buf), 1);
+      continue;
+    }
+    n = EG_output_claim(seg, sizeof(buf), 1, &ticket);
+    if (n)
+    {
+      EG_output_release(ticket);
+    }
+    nread[id] += n;
+  }
+  return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+  pthread_t prod[EG_PRODUCERS], rd[EG_READERS];
+  unsigned char seed[64];
+  unsigned long adds = 0, drops = 0, bytes = 0;
+  double secs, start;
+  long vol0, invol0, vol, invol;
+  int i;
+
+  secs = (argc > 1 ? atof(argv[1]) : 3.0);
+  if (argc > 2)
+  {
+    EG_set_reservoir(strtoul(argv[2], NULL, 10));
+  }
+  claim = (argc > 3 && !strcmp(argv[3], "claim"));
+
+  EG_init();
+  for (i = 0;  i < NUM_SOURCES;  i++)
+  {
+    sources[i] = EG_register_source();
+  }
+  memset(seed, 0x5a, sizeof(seed));
+  EG_add_entropy(sources[0], seed, sizeof(seed), 0);
+  EG_startup_done();
+
+  printf("eg: %d producers over %d sources, %d readers of %d bytes, "
+         "%lu byte reservoir, %s\n", EG_PRODUCERS, NUM_SOURCES, EG_READERS,
+         EG_READ_LEN, (unsigned long)EG_set_reservoir(0),
+         (claim ? "claim" : "copy"));
+  switches(&vol0, &invol0);
+  start = now();
+  for (i = 0;  i < EG_READERS;  i++)
+  {
+    pthread_create(&rd[i], NULL, reader, (void *)(long)i);
+  }
+  for (i = 0;  i < EG_PRODUCERS;  i++)
+  {
+    pthread_create(&prod[i], NULL, producer, (void *)(long)i);
+  }
+
+  usleep((useconds_t)(secs * 1e6));
+  stop = 1;
+  for (i = 0;  i < EG_PRODUCERS;  i++)
+  {
+    pthread_join(prod[i], NULL);
+    adds += added[i];
+    drops += lost[i];
+  }
+  secs = now() - start;
+  switches(&vol, &invol);
+  for (i = 0;  i < EG_READERS;  i++)
+  {
+    pthread_cancel(rd[i]);
+    pthread_join(rd[i], NULL);
+    bytes += nread[i];
+  }
+
+  printf("%14s %14s %14s %14s %14s\n", "Msamples/s", "dropped",
+         "output KB/s", "vol csw/s", "invol csw/s");
+  printf("%14.2f %14lu %14.1f %14.0f %14.0f\n", adds / secs / 1e6, drops,
+         bytes / secs / 1e3, (vol - vol0) / secs, (invol - invol0) / secs);
+  return 0;
+}
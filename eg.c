@@ -3,12 +3,29 @@
 #include "eg.h"
 #include "sha1.h"
 
+#ifndef WIN32
+#include <sys/mman.h> /* mlock() */
+#endif
+
 static int estimates[NUM_SOURCES];
+/* Kept up as the estimates change: etotal over the registered sources, and
+ * the NUM_COMP_SRCS sources with the highest estimates, highest first,
+ * which the level leaves out. elevel is the level last published.
+ */
+static int etotal = 0;
+static int topsrc[NUM_COMP_SRCS];
+static int ntop = 0;
+static int elevel = 0;
 static unsigned char umackey[UMAC_KEY_LEN];
-static unsigned char outbuf[(BUFSZ*UMAC_OUTPUT_LEN)+1];
-static unsigned char *oend;
-static unsigned char *ohead;
-static unsigned char *otail;
+/* Output waiting for clients, in a power of 2 sized ring. rfree, rhead and
+ * rtail run freely; rtail - rhead bytes are in stock. Bytes from rfree to
+ * rhead have been claimed by readers that are still sending them straight
+ * out of the ring (see EG_output_claim()) and can't be refilled yet.
+ */
+static unsigned char *reservoir = NULL;
+static size_t rsize = EG_RESERVOIR_DEFAULT;
+static size_t rfree, rhead, rtail;
+static int refilling = 1;   /* Below the low watermark, not yet back up */
 static int sources = 0;
 static int octr = 0;
 static int keyed = 0;
@@ -24,9 +41,49 @@ static SHA_CTX shactx;
 
 #ifndef NO_THREADS
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t entready = PTHREAD_COND_INITIALIZER;
 #endif
 
+#if !defined(NO_THREADS) && !defined(WIN32) && defined(__ATOMIC_SEQ_CST)
+#define EG_MIXER 1
+#endif
+
+#ifdef EG_MIXER
+/*
+ * Collectors never take lock. Each source has a ring of samples, filled by
+ * any number of threads without locking and drained by the mixer thread,
+ * which does all the UMAC work under lock in batches. This is a bounded
+ * queue after Vyukov: a slot's seq equals the position a producer may claim
+ * it at when free, and that position + 1 once it holds a sample. A full
+ * ring drops the sample rather than wait.
+ */
+typedef struct eg_slot_t {
+  unsigned long seq;
+  int len, est;
+  unsigned char data[EG_SAMPLE_LEN];
+} eg_slot_t;
+
+typedef struct eg_ring_t {
+  unsigned long head;   /* Next position for producers */
+  char pad1[64 - sizeof(unsigned long)];
+  unsigned long tail;   /* Next position for the mixer, under lock */
+  char pad2[64 - sizeof(unsigned long)];
+  eg_slot_t slots[EG_RING_SLOTS];
+} eg_ring_t;
+
+static eg_ring_t rings[NUM_SOURCES] __attribute__((aligned(64)));
+static int pending;             /* Samples queued since the mixer looked */
+static int mixing = 0;          /* Whether the mixer thread is running */
+static pthread_t mixer;
+static pthread_mutex_t mixlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mixready = PTHREAD_COND_INITIALIZER;
+
+static void eg_drain(void);
+#else
+#define eg_drain()
+#endif
+
+static void eg_publish_level(void);
+
 static void
 eg_zero_estimates(void)
 {
@@ -36,6 +93,8 @@ eg_zero_estimates(void)
   {
     estimates[i] = 0;
   }
+  etotal = 0;
+  ntop = 0;
 }
 
 static void
@@ -59,6 +118,8 @@ EG_register_source()
   else
   {
     rval = sources++;
+    etotal += estimates[rval];
+    eg_publish_level();
   }
   pthread_mutex_unlock(&lock);
 
@@ -112,138 +173,269 @@ eg_out_spool(char *data, int length)
   slowcount++;
 }
       
+/* Claims on the ring, oldest first. They can be released in any order;
+ * rfree moves up past each one as it and everything before it is let go.
+ */
+typedef struct eg_claim_t {
+  size_t start, end;
+  int held;
+} eg_claim_t;
+
+static eg_claim_t claims[EG_MAX_CLAIMS];
+static unsigned int cfirst, cnext;
+
+#ifndef NO_THREADS
+/* Blocked readers queue up in arrival order, each on its own condition.
+ * Only the head is woken, once the stock covers what it still wants or
+ * reaches EG_WAKE_QUANTUM; it passes the wakeup on when done. Readers that
+ * still want more after that go to the back of the queue.
+ */
+typedef struct eg_waiter_t {
+  struct eg_waiter_t *next;
+  int want;
+  int woken;
+  pthread_cond_t cond;
+} eg_waiter_t;
+
+static eg_waiter_t *whead = NULL, *wtail = NULL;
+
+static void eg_wake_head(void);
+#else
+#define eg_wake_head()
+#endif
+
+/* Describe the n bytes of the ring from pos as at most 2 segments */
+static int
+eg_segments(size_t pos, size_t n, eg_seg_t *seg)
+{
+  size_t off = pos & (rsize - 1);
+
+  seg[0].ptr = &reservoir[off];
+  seg[0].len = (n < rsize - off ? n : rsize - off);
+  seg[1].ptr = reservoir;
+  seg[1].len = n - seg[0].len;
+  return (seg[1].len ? 2 : 1);
+}
+
 static int 
 eg_buf_full(void)
 {
-  unsigned char *tmp = ohead + 7;
-  unsigned char *ftmp = NULL;
-
-  if (tmp > oend)
-  {
-    tmp = outbuf + (tmp - (oend + 1));
-  }
-  
-  ftmp = otail + 1;
-  if (ftmp > oend)
-  {
-    ftmp = outbuf;
-  }
-  
-  return (ftmp == ohead);
+  return (rtail - rfree == rsize);
 }
 
 static void
 eg_out_buf(char *data, int length)
 {
-  int tocopy;
-  unsigned char *lim;
+  eg_seg_t seg[2];
+  size_t tocopy;
 
-  if (eg_buf_full())
+  tocopy = rsize - (rtail - rfree);
+  if (tocopy > (size_t)length)
   {
-    return;
-  }
-  
-  if (otail == oend)
-  {
-    otail = outbuf;
+    tocopy = length;
   }
-  if (ohead == oend)
+  if (tocopy == 0)
   {
-    ohead = outbuf;
+    return;
   }
-  
-  if (ohead > otail && ohead <= oend)
+
+  eg_segments(rtail, tocopy, seg);
+  memcpy(seg[0].ptr, data, seg[0].len);
+  memcpy(seg[1].ptr, &data[seg[0].len], seg[1].len);
+  rtail += tocopy;
+
+  if (rtail - rhead >= EG_HIGH_WATER(rsize))
   {
-    lim = ohead;
+    refilling = 0;
   }
-  else
+  eg_wake_head();
+}
+
+static int
+entropy_available(void)
+{
+  if (!keyed)
+      return 0;
+
+  return (rhead != rtail);
+}
+
+/* Whether a reader can take anything right now */
+static int
+eg_can_take(void)
+{
+  return (entropy_available() && cnext - cfirst < EG_MAX_CLAIMS);
+}
+
+static void
+eg_wipe(size_t pos, size_t n)
+{
+  eg_seg_t seg[2];
+
+  eg_segments(pos, n, seg);
+  memset(seg[0].ptr, 0, seg[0].len);
+  memset(seg[1].ptr, 0, seg[1].len);
+}
+
+/* Take up to howmuch bytes of stock as a new claim. Call eg_can_take()
+ * first. Returns the claim's ticket.
+ */
+static unsigned int
+eg_take(int howmuch, int held)
+{
+  eg_claim_t *c = &claims[cnext % EG_MAX_CLAIMS];
+  size_t n;
+
+  n = rtail - rhead;
+  if (n > (size_t)howmuch)
   {
-    lim = oend;
+    n = howmuch;
   }
+  c->start = rhead;
+  c->end = rhead + n;
+  c->held = held;
+  rhead += n;
 
-  tocopy = lim - otail;
-  if (tocopy > length)
+  if (rtail - rhead < EG_LOW_WATER(rsize))
   {
-    tocopy = length;
+    refilling = 1;
   }
-  
-  memcpy(otail, data, tocopy);
-  otail += tocopy;
-  if (otail > oend)
+  eg_publish_level();
+  return cnext++;
+}
+
+/* Free the ring up to the oldest claim still held */
+static void
+eg_retire(void)
+{
+  int wasfull = (cnext - cfirst == EG_MAX_CLAIMS);
+
+  while (cfirst != cnext && !claims[cfirst % EG_MAX_CLAIMS].held)
   {
-    otail = outbuf;
+    rfree = claims[cfirst % EG_MAX_CLAIMS].end;
+    cfirst++;
   }
-  
-  if (!eg_buf_full() && (length - tocopy > 0))
+  if (wasfull && cnext - cfirst < EG_MAX_CLAIMS)
   {
-    eg_out_buf(&data[tocopy], length - tocopy);
+    eg_wake_head();
   }
-
-  pthread_cond_broadcast(&entready);
 }
 
-static int
-entropy_available(void)
+/* Hand out up to howmuch bytes from stock, wiping them behind us */
+static int 
+eg_fill_entropy(char *out, int howmuch)
 {
-  if (!keyed)
-      return 0;
-
-  return (ohead != otail);
+  eg_seg_t seg[2];
+  eg_claim_t *c;
+
+  c = &claims[eg_take(howmuch, 0) % EG_MAX_CLAIMS];
+  eg_segments(c->start, c->end - c->start, seg);
+  memcpy(out, seg[0].ptr, seg[0].len);
+  memcpy(&out[seg[0].len], seg[1].ptr, seg[1].len);
+  eg_wipe(c->start, c->end - c->start);
+  eg_retire();
+  return (int)(c->end - c->start);
 }
 
-static int 
-eg_fill_entropy(char *out, int howmuch)
+#ifndef NO_THREADS
+static void
+eg_wake_head(void)
 {
-  int tocopy;
-  int ret = 0;
-  unsigned char *lim;
-  
-  if (otail > ohead && otail <= oend) 
+  eg_waiter_t *w = whead;
+  size_t stock = rtail - rhead;
+
+  if (!w || !eg_can_take())
   {
-    lim = otail;
+    return;
   }
-  else
+  if (stock < (size_t)w->want && stock < EG_WAKE_QUANTUM && !eg_buf_full())
   {
-    lim = oend;
+    return;
   }
 
-  tocopy = lim-ohead;
-  if (tocopy > howmuch)
-  {
-    tocopy = howmuch;
-  }
-  memcpy(out, ohead, tocopy);
-  ohead += tocopy;
-  if (ohead >= oend)
+  whead = w->next;
+  if (!whead)
   {
-    ohead = outbuf;
+    wtail = NULL;
   }
-  if (otail >= oend)
+  w->woken = 1;
+  pthread_cond_signal(&w->cond);
+}
+
+/* Cancelled while queued: leave the queue, or pass on a wakeup we got */
+static void
+eg_unwait(void *arg)
+{
+  eg_waiter_t *w = (eg_waiter_t *)arg, *prev = NULL, *p;
+
+  if (!w->woken)
   {
-    otail = outbuf;
+    for (p = whead;  p != w;  p = p->next)
+    {
+      prev = p;
+    }
+    if (prev)
+    {
+      prev->next = w->next;
+    }
+    else
+    {
+      whead = w->next;
+    }
+    if (wtail == w)
+    {
+      wtail = prev;
+    }
   }
-  ret += tocopy;
-  if (ohead != otail && (howmuch - tocopy > 0))
+  else
   {
-    ret += eg_fill_entropy(&out[tocopy], howmuch - tocopy);
+    eg_wake_head();
   }
-  return ret;
+  pthread_cond_destroy(&w->cond);
+  pthread_mutex_unlock(&lock);
 }
 
+/* Queue for want bytes and sleep until it is our turn. Call under lock. */
 static void
-eg_cleanup(void *arg)
+eg_wait(eg_waiter_t *w, int want)
 {
-  pthread_mutex_unlock((pthread_mutex_t *)arg);
+  w->next = NULL;
+  w->want = want;
+  w->woken = 0;
+  pthread_cond_init(&w->cond, NULL);
+  if (wtail)
+  {
+    wtail->next = w;
+  }
+  else
+  {
+    whead = w;
+  }
+  wtail = w;
+  eg_wake_head();
+
+  pthread_cleanup_push(eg_unwait, w);
+  while (!w->woken)
+  {
+    pthread_cond_wait(&w->cond, &lock);
+  }
+  pthread_cleanup_pop(0);
+  pthread_cond_destroy(&w->cond);
 }
+#endif
 
 int 
 EG_output(char *out, int howmuch, int block)
 {
   int copied = 0;
+#ifndef NO_THREADS
+  eg_waiter_t w;
+  int turn = 0;
+#endif
 
   pthread_mutex_lock(&lock);
 #ifdef NO_THREADS
-  if (!entropy_available())
+  if (!eg_can_take())
   {
     pthread_mutex_unlock(&lock);
     return 0;
@@ -251,22 +443,83 @@ EG_output(char *out, int howmuch, int block)
   
   return eg_fill_entropy(out, howmuch);
 #else
-  do
+  /* Blocking readers wait their turn behind any already queued */
+  while (copied < howmuch)
   {
-    if (block && !entropy_available())
+    if (!eg_can_take() || (block && whead && !turn))
     {
-      pthread_cleanup_push(eg_cleanup, &lock);
-      pthread_cond_wait(&entready, &lock);
-      pthread_cleanup_pop(0);
+      if (!block)
+      {
+        break;
+      }
+      eg_wait(&w, howmuch - copied);
+      turn = 1;
+      continue;
     }
     copied += eg_fill_entropy(&out[copied], howmuch - copied);
-  } 
-  while (block && copied < howmuch);
+    turn = 0;
+  }
+  eg_wake_head();
 #endif
   pthread_mutex_unlock(&lock);
   return copied;
 }
 
+/* Claim up to howmuch bytes of output where they lie in the reservoir, as
+ * at most 2 segments in seg, so they can be written out without copying.
+ * Blocks for stock if block is set. Returns the number of bytes claimed,
+ * with the claim's ticket in *ticket. A claim of any bytes must be given
+ * back to EG_output_release() as soon as they are sent, since the reservoir
+ * can't be refilled past it until then.
+ */
+int
+EG_output_claim(eg_seg_t *seg, int howmuch, int block,
+                unsigned int *ticket)
+{
+  eg_claim_t *c;
+#ifndef NO_THREADS
+  eg_waiter_t w;
+
+  pthread_mutex_lock(&lock);
+  if (block && howmuch > 0 && whead)
+  {
+    eg_wait(&w, howmuch);
+  }
+  while (block && howmuch > 0 && !eg_can_take())
+  {
+    eg_wait(&w, howmuch);
+  }
+#else
+  pthread_mutex_lock(&lock);
+#endif
+  if (howmuch <= 0 || !eg_can_take())
+  {
+    pthread_mutex_unlock(&lock);
+    seg[0].len = seg[1].len = 0;
+    return 0;
+  }
+  *ticket = eg_take(howmuch, 1);
+  c = &claims[*ticket % EG_MAX_CLAIMS];
+  eg_segments(c->start, c->end - c->start, seg);
+  eg_wake_head();
+  pthread_mutex_unlock(&lock);
+  return (int)(c->end - c->start);
+}
+
+/* Wipe the bytes of a claim and hand its room back for refilling */
+void
+EG_output_release(unsigned int ticket)
+{
+  eg_claim_t *c;
+
+  pthread_mutex_lock(&lock);
+  c = &claims[ticket % EG_MAX_CLAIMS];
+  eg_wipe(c->start, c->end - c->start);
+  c->held = 0;
+  eg_retire();
+  pthread_mutex_unlock(&lock);
+}
+
 static void
 eg_do_output(void)
 {
@@ -295,31 +548,69 @@ eg_do_output(void)
   
 }
 
-static int
-cmpint(const void *p1, const void *p2)
+/* Move srcnum, whose estimate just went up, into place among the top */
+static void
+eg_rank_source(int srcnum)
 {
-  int i1 = *((int *)p1), i2 = *((int *)p2);
+  int k;
 
-  return (i1 > i2 ? -1 : (i1 < i2 ? 1 : 0));
+  for (k = 0;  k < ntop && topsrc[k] != srcnum;  k++)
+    ;
+  if (k == ntop)
+  {
+    if (ntop < NUM_COMP_SRCS)
+    {
+      k = ntop++;
+    }
+    else if (estimates[srcnum] > estimates[topsrc[NUM_COMP_SRCS - 1]])
+    {
+      k = NUM_COMP_SRCS - 1;
+    }
+    else
+    {
+      return;
+    }
+  }
+  for (;  k > 0 && estimates[topsrc[k - 1]] < estimates[srcnum];  k--)
+  {
+    topsrc[k] = topsrc[k - 1];
+  }
+  topsrc[k] = srcnum;
+}
+
+static void
+eg_set_estimate(int srcnum, int value)
+{
+  int i, old = estimates[srcnum];
+
+  estimates[srcnum] = value;
+  if (srcnum < sources)
+  {
+    etotal += value - old;
+  }
+  if (value > old)
+  {
+    eg_rank_source(srcnum);
+  }
+  else if (value < old)
+  {
+    ntop = 0;
+    for (i = 0;  i < NUM_SOURCES;  i++)
+    {
+      eg_rank_source(i);
+    }
+  }
 }
 
 static int
 eg_compute_elevel()
 {
   int i;
-  int estcpy[NUM_SOURCES];
-  int totale = 0;
+  int totale = etotal;
 
-  memcpy(estcpy, estimates, NUM_SOURCES * sizeof(int));
-  qsort((void *)estcpy, NUM_SOURCES, sizeof(int), cmpint);
-
-  for (i = 0;  i < sources;  i++)
-  {
-    totale += estimates[i];
-  }
-  for (i = 0;  i < NUM_COMP_SRCS;  i++)
+  for (i = 0;  i < ntop;  i++)
   {
-    totale -= estcpy[i];
+    totale -= estimates[topsrc[i]];
   }
 
   return totale;
@@ -334,24 +625,48 @@ eg_output_ready()
   return (totale > UMAC_OUTPUT_LEN * 8);
 }
 
-double
-EG_entropy_level()
+/* Publish the level for EG_entropy_level(). Called with lock held whenever
+ * the estimates or the stock change.
+ */
+static void
+eg_publish_level(void)
 {
-  double ret;
-  int totale;
+  int level;
 
-  pthread_mutex_lock(&lock);
   if (keyed && entropy_available())
   {
-    ret = 1.0;
+    level = UMAC_OUTPUT_LEN * 8;
   }
   else
   {
-    totale = eg_compute_elevel();
-    ret = (double)totale / (UMAC_OUTPUT_LEN * 8);
+    level = eg_compute_elevel();
   }
+#ifdef __ATOMIC_SEQ_CST
+  __atomic_store_n(&elevel, level, __ATOMIC_RELEASE);
+#else
+  elevel = level;
+#endif
+}
+
+/* Reads the published level without taking lock, where atomics allow, so
+ * polling clients stay out of the mixer's way. Samples the mixer has yet
+ * to drain are not counted.
+ */
+double
+EG_entropy_level()
+{
+  int level;
+
+#ifdef __ATOMIC_SEQ_CST
+  level = __atomic_load_n(&elevel, __ATOMIC_ACQUIRE);
+#else
+  pthread_mutex_lock(&lock);
+  eg_drain();
+  eg_publish_level();
+  level = elevel;
   pthread_mutex_unlock(&lock);
-  return ret;
+#endif
+  return (double)level / (UMAC_OUTPUT_LEN * 8);
 }
 
 #define ROTATE(x) ((x) % EPOOLSZ)   /* Convenient abreviation */
@@ -398,6 +713,10 @@ EG_startup_done(void)
 {
 
   unsigned char shaout[20] = {0};
+
+  pthread_mutex_lock(&lock);
+  /* Everything collected so far belongs to the startup hash */
+  eg_drain();
   SHAUpdate(&shactx, umackey, UMAC_KEY_LEN);
   SHAFinal(shaout, &shactx);
   
@@ -417,41 +736,206 @@ EG_startup_done(void)
   
   eg_umac_ctx = umac_new(umackey);
   keyed = 1;
+  eg_publish_level();
+  pthread_mutex_unlock(&lock);
 
   return;
 }
 
+/* Mix one sample into the pool. Called with lock held. */
+static void
+eg_mix_sample(int srcnum, unsigned char *ent, int len, int est)
+{
+  if (!keyed)  
+  {
+      eg_startup_data(ent, len);
+      return;
+  }
+
+  est += estimates[srcnum];
+  eg_set_estimate(srcnum, (est > 70 ? 70 : est));
+  eg_mix_entropy(ent, len);
+
+  if (eg_output_ready())
+  {
+    eg_do_output();
+  }
+  eg_publish_level();
+}
+
+#ifdef EG_MIXER
+static int
+ring_push(eg_ring_t *r, unsigned char *ent, int len, int est)
+{
+  eg_slot_t *slot;
+  unsigned long pos, seq;
+
+  pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+  for (;;)
+  {
+    slot = &r->slots[pos & (EG_RING_SLOTS - 1)];
+    seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if (seq == pos)
+    {
+      if (__atomic_compare_exchange_n(&r->head, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      {
+        break;
+      }
+    }
+    else if ((long)(seq - pos) < 0)
+    {
+      return 0;
+    }
+    else
+    {
+      pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    }
+  }
+
+  memcpy(slot->data, ent, len);
+  slot->len = len;
+  slot->est = est;
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+/* Mix every queued sample. Called with lock held, which makes the caller
+ * the only consumer of the rings. The rings are taken a sample at a time
+ * in turn, so that the estimates see the sources interleaved as they were
+ * when collectors mixed their samples in directly; draining one ring at a
+ * time would leave a single source counting, which eg_compute_elevel
+ * discards.
+ */
+static void
+eg_drain(void)
+{
+  eg_ring_t *r;
+  eg_slot_t *slot;
+  int i, n, more = 1;
+
+  /* At most one lap, so busy producers cannot keep us here */
+  for (n = 0;  more && n < EG_RING_SLOTS;  n++)
+  {
+    more = 0;
+    for (i = 0;  i < NUM_SOURCES;  i++)
+    {
+      r = &rings[i];
+      slot = &r->slots[r->tail & (EG_RING_SLOTS - 1)];
+      if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != r->tail + 1)
+      {
+        continue;
+      }
+      eg_mix_sample(i, slot->data, slot->len, slot->est);
+      memset(slot->data, 0, slot->len);
+      __atomic_store_n(&slot->seq, r->tail + EG_RING_SLOTS, __ATOMIC_RELEASE);
+      r->tail++;
+      more = 1;
+    }
+  }
+}
+
+/* Only the first producer after the mixer has looked takes mixlock, and
+ * the mixer holds it just long enough to go to sleep.
+ */
+static void
+eg_wake_mixer(void)
+{
+  if (!__atomic_exchange_n(&pending, 1, __ATOMIC_SEQ_CST))
+  {
+    pthread_mutex_lock(&mixlock);
+    pthread_cond_signal(&mixready);
+    pthread_mutex_unlock(&mixlock);
+  }
+}
+
+static void *
+eg_mixer(void *arg)
+{
+  for (;;)
+  {
+    pthread_mutex_lock(&mixlock);
+    while (!__atomic_exchange_n(&pending, 0, __ATOMIC_SEQ_CST))
+    {
+      pthread_cond_wait(&mixready, &mixlock);
+    }
+    pthread_mutex_unlock(&mixlock);
+
+    pthread_mutex_lock(&lock);
+    eg_drain();
+    pthread_mutex_unlock(&lock);
+  }
+  return NULL;
+}
+
+static void
+eg_rings_init(void)
+{
+  int i, j;
+
+  for (i = 0;  i < NUM_SOURCES;  i++)
+  {
+    rings[i].head = 0;
+    rings[i].tail = 0;
+    for (j = 0;  j < EG_RING_SLOTS;  j++)
+    {
+      rings[i].slots[j].seq = j;
+    }
+  }
+  pending = 0;
+}
+#endif
+
+/* Returns 1 once the sample is queued (or mixed), 0 if it had to be dropped
+ * and -1 for a bad source.
+ */
 int
 EG_add_entropy(int srcnum, unsigned char *ent, int len,  int est)
 {
-  pthread_mutex_lock(&lock);
+#ifdef EG_MIXER
+  int ok = 1;
+
   if (srcnum < 0 || srcnum >= NUM_SOURCES)
   {
-    pthread_mutex_unlock(&lock);
     return -1;
   }
 
-
-  if (!keyed)  
+  /* The estimate goes with the last piece, so it is dropped if any is */
+  while (ok && len > EG_SAMPLE_LEN)
   {
-      eg_startup_data(ent, len);
-      pthread_mutex_unlock(&lock);
-      return 1;
+    ok = ring_push(&rings[srcnum], ent, EG_SAMPLE_LEN, 0);
+    ent += EG_SAMPLE_LEN;
+    len -= EG_SAMPLE_LEN;
   }
+  ok = ok && ring_push(&rings[srcnum], ent, len, est);
 
-  estimates[srcnum] += est;
-  if (estimates[srcnum] > 70)
+  if (mixing)
   {
-    estimates[srcnum] = 70;
+    eg_wake_mixer();
+    if (!ok)
+    {
+      /* We are outrunning the mixer; give it the CPU */
+      sched_yield();
+    }
   }
-  eg_mix_entropy(ent, len);
-
-  if (eg_output_ready())
+  else
   {
-    eg_do_output();
+    pthread_mutex_lock(&lock);
+    eg_drain();
+    pthread_mutex_unlock(&lock);
+  }
+  return ok;
+#else
+  pthread_mutex_lock(&lock);
+  if (srcnum < 0 || srcnum >= NUM_SOURCES)
+  {
+    pthread_mutex_unlock(&lock);
+    return -1;
   }
+  eg_mix_sample(srcnum, ent, len, est);
   pthread_mutex_unlock(&lock);
   return 1;
+#endif
 }
 
 int
@@ -476,12 +960,48 @@ EG_restore_state(FILE *from)
   return 1;
 }
 
+/* Size the reservoir, in bytes. Rounded up to a power of 2 and clamped to
+ * [EG_RESERVOIR_MIN, EG_RESERVOIR_MAX]. Only has an effect before EG_init.
+ * Returns the size that will be used.
+ */
+size_t
+EG_set_reservoir(size_t bytes)
+{
+  size_t size = EG_RESERVOIR_MIN;
+
+  pthread_mutex_lock(&lock);
+  if (!reservoir)
+  {
+    while (size < bytes && size < EG_RESERVOIR_MAX)
+    {
+      size <<= 1;
+    }
+    rsize = size;
+  }
+  size = rsize;
+  pthread_mutex_unlock(&lock);
+  return size;
+}
+
+/* Whether the collectors should run flat out: from the time the stock
+ * falls below the low watermark until it is back up to the high one.
+ */
+int
+EG_refill_wanted(void)
+{
+  int ret;
+
+  pthread_mutex_lock(&lock);
+  ret = refilling;
+  pthread_mutex_unlock(&lock);
+  return ret;
+}
+
 int
 EG_init()
 {
 #ifdef WIN32
   lock = CreateMutex(NULL, TRUE, NULL);
-  entready = CreateEvent(NULL, TRUE, FALSE, NULL);
 #else
   pthread_mutex_lock(&lock);
 #endif
@@ -492,10 +1012,39 @@ EG_init()
   eg_umac_ctx = umac_new(umackey);
   slowthresh = SPOOL_THRESH_START;
   /* TODO: Hash based startup and such */
-  oend = &outbuf[(BUFSZ * UMAC_OUTPUT_LEN)];
-  ohead = outbuf;
-  otail = outbuf;  
+  if (!reservoir)
+  {
+    EGADS_ALLOC(reservoir, rsize, 1);
+    if (!reservoir)
+    {
+      pthread_mutex_unlock(&lock);
+      return 0;
+    }
+    memset(reservoir, 0, rsize);
+#ifndef WIN32
+    if (mlock(reservoir, rsize))
+#else
+    if (!VirtualLock(reservoir, rsize))
+#endif
+    {
+      fprintf(stderr, "Warning: Using insecure memory.\n");
+    }
+  }
+  rfree = 0;
+  rhead = 0;
+  rtail = 0;
+  cfirst = 0;
+  cnext = 0;
+  refilling = 1;
   eg_zero_spool();
+#ifdef EG_MIXER
+  if (!mixing)
+  {
+    eg_rings_init();
+    mixing = !pthread_create(&mixer, NULL, eg_mixer, NULL);
+  }
+#endif
+  eg_publish_level();
   pthread_mutex_unlock(&lock);
   return 1;
 }
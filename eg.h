@@ -2,7 +2,6 @@
 #include "egadspriv.h"
 
 #define EPOOLSZ 512
-#define BUFSZ 31 
 #define EPOOL_OUTD 10
 #define EPOOL_OUTN 1
 #define SPOOL_SIZE 32
@@ -12,6 +11,34 @@
 
 #define NUM_COMP_SRCS 1
 
+/* Output reservoir, see EG_set_reservoir(). The collectors run flat out
+ * from when the stock falls below the low watermark until it reaches the
+ * high one.
+ */
+#define EG_RESERVOIR_MIN      256
+#define EG_RESERVOIR_MAX      (64 << 20)
+#define EG_RESERVOIR_DEFAULT  4096
+#define EG_LOW_WATER(size)    ((size) / 4)
+#define EG_HIGH_WATER(size)   (size)
+
+/* A run of the output reservoir, see EG_output_claim() */
+typedef struct eg_seg_t {
+  void *ptr;
+  size_t len;
+} eg_seg_t;
+
+/* Most output claims outstanding at once, see EG_output_claim() */
+#define EG_MAX_CLAIMS 64
+
+/* A blocked reader is woken once this much stock is in, even if it wants
+ * more; it takes what there is and goes to the back of the queue.
+ */
+#define EG_WAKE_QUANTUM 256
+
+/* Samples queued for the mixer thread, see eg.c */
+#define EG_RING_SLOTS 1024  /* Per source; a power of 2 */
+#define EG_SAMPLE_LEN 48    /* Longer samples are queued in pieces */
+
 
 #if EPOOLSZ == 2048   /* 115 x^2048+x^1638+x^1231+x^819+x^411+x^1+1 */
 #define TAP1    1638
@@ -68,7 +95,12 @@
 
 extern int EG_add_entropy(int srcnum, unsigned char *ent, int len,  int est);
 extern int EG_output(char *out, int howmuch, int block);
+extern int EG_output_claim(eg_seg_t *seg, int howmuch, int block,
+                           unsigned int *ticket);
+extern void EG_output_release(unsigned int ticket);
 extern int EG_init(void);
+extern size_t EG_set_reservoir(size_t bytes);
+extern int EG_refill_wanted(void);
 extern int EG_register_source(void);
 extern int EG_save_state(FILE *);
 extern int EG_restore_state(FILE *);
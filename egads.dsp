@@ -100,6 +100,10 @@ LINK32=link.exe
 # PROP Default_Filter "cpp;c;cxx;rc;def;r;odl;idl;hpj;bat"
 # Begin Source File
 
+SOURCE=.\chacha.c
+# End Source File
+# Begin Source File
+
 SOURCE=.\win32\client.c
 # End Source File
 # Begin Source File
@@ -118,6 +122,10 @@ SOURCE=.\randlib.c
 
 SOURCE=.\umac.c
 # End Source File
+# Begin Source File
+
+SOURCE=.\ziggurat.c
+# End Source File
 # End Group
 # Begin Group "Header Files"
 
@@ -128,6 +136,10 @@ SOURCE=.\byteswap.h
 # End Source File
 # Begin Source File
 
+SOURCE=.\chacha.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\egads.h.in
 # End Source File
 # Begin Source File
@@ -138,6 +150,10 @@ SOURCE=.\platform.h
 
 SOURCE=.\umac.h
 # End Source File
+# Begin Source File
+
+SOURCE=.\ziggurat.h
+# End Source File
 # End Group
 # Begin Group "Resource Files"
 
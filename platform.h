@@ -24,14 +24,19 @@
                               } while (0)
 
 typedef DWORD  pthread_t;
+typedef DWORD  pthread_key_t;
 typedef HANDLE pthread_cond_t;
 typedef HANDLE pthread_mutex_t;
 
 #define PTHREAD_COND_INITIALIZER    NULL    /* CreateMutex(NULL, FALSE, NULL) */
 #define PTHREAD_MUTEX_INITIALIZER   NULL    /* CreateEvent(NULL, FALSE, FALSE, NULL) */
 
+#define pthread_mutex_init(x, y)  (*(x) = CreateMutex(NULL, FALSE, NULL))
+#define pthread_mutex_destroy(x)  CloseHandle(*(x))
 #define pthread_mutex_lock(x)     WaitForSingleObject(*(x), INFINITE)
 #define pthread_mutex_unlock(x)   ReleaseMutex(*(x))
+#define pthread_cond_init(x, y)   (*(x) = CreateEvent(NULL, FALSE, FALSE, NULL))
+#define pthread_cond_destroy(x)   CloseHandle(*(x))
 #define pthread_cond_signal(x)    SetEvent(*(x))
 #define pthread_cond_broadcast(x) PulseEvent(*(x))
 #define pthread_cond_wait(x, y)   do { \
@@ -43,13 +48,25 @@ typedef HANDLE pthread_mutex_t;
 #define pthread_cleanup_push(x, y)
 #define pthread_cleanup_pop(x)
 
+/* TLS slots have no destructor; values left behind by exiting threads are
+ * reclaimed when the key is deleted.
+ */
+#define pthread_key_create(k, d)  ((*(k) = TlsAlloc()) == TLS_OUT_OF_INDEXES)
+#define pthread_key_delete(k)     TlsFree((k))
+#define pthread_getspecific(k)    TlsGetValue((k))
+#define pthread_setspecific(k, v) TlsSetValue((k), (v))
+
 #else   /* !WIN32 */
 
 #ifndef NO_THREADS
 #include <pthread.h>
 #else
+#define pthread_mutex_init(x, y)
+#define pthread_mutex_destroy(x)
 #define pthread_mutex_lock(x)
 #define pthread_mutex_unlock(x)
+#define pthread_cond_init(x, y)
+#define pthread_cond_destroy(x)
 #define pthread_cond_wait(x, y)
 #define pthread_cond_signal(x)
 #define pthread_cond_broadcast(x)
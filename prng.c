@@ -1,20 +1,132 @@
 #include "platform.h"
 #include "umac.h"
+#include "chacha.h"
 
 #ifndef WIN32
-#include <sys/mman.h> /* mlock() */
+#include <sys/mman.h> /* mlock(), mmap() */
+#include <time.h>     /* clock_gettime() */
+#if defined(MAP_ANON) && !defined(MAP_ANONYMOUS)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
 #endif
 
-#ifndef NO_THREADS
-static pthread_mutex_t liblock = PTHREAD_MUTEX_INITIALIZER;
-static struct timeval forkedat;
+/* Counter blocks generated and encrypted together by internal_output_bytes */
+#define PRNG_BATCH_BLOCKS 8
+
+/* Cipher blocks produced under one key: GATE_SIZE bytes of keystream,
+ * whatever the block size of the cipher.
+ */
+#define KEY_BLOCKS(c)   (GATE_SIZE / (c)->blocklen)
+
+#define CIPHER_KEY(c)   ((c)->flags & PRNG_CHACHA20 ? (void *)(c)->chachakey \
+                                                    : (void *)(c)->cctx)
+#define CIPHER_KEY_LEN(c) ((c)->flags & PRNG_CHACHA20 ? sizeof((c)->chachakey) \
+                                                      : sizeof((c)->cctx))
+
+/* Contexts created with PRNG_SINGLE_OWNER are never shared between threads
+ * and skip their lock entirely.
+ */
+#define PRNG_LOCK(c)    do { \
+                          if (!((c)->flags & PRNG_SINGLE_OWNER)) \
+                            pthread_mutex_lock(&(c)->lock);      \
+                        } while (0)
+#define PRNG_UNLOCK(c)  do { \
+                          if (!((c)->flags & PRNG_SINGLE_OWNER)) \
+                            pthread_mutex_unlock(&(c)->lock);    \
+                        } while (0)
+
+#if !defined(NO_THREADS) && !defined(WIN32)
+static volatile unsigned long forkgen;  /* Bumped in every child of fork() */
+static pthread_once_t forkgen_once = PTHREAD_ONCE_INIT;
+#else
+#define forkgen 0
+#endif
+
+/* The rekey deadline is polled on every request, so it is kept on the
+ * cheapest monotonic clock around. Being a few milliseconds late doesn't
+ * matter.
+ */
+#if defined(CLOCK_MONOTONIC_COARSE)
+#define PRNG_CLOCK      CLOCK_MONOTONIC_COARSE
+#elif defined(CLOCK_MONOTONIC)
+#define PRNG_CLOCK      CLOCK_MONOTONIC
+#endif
+
+#if !defined(NO_THREADS) && !defined(WIN32)
+#define RESEED_THREAD   1
+#endif
+
+/* c->reseedstate */
+#define RESEED_IDLE     0     /* No seed requested */
+#define RESEED_QUEUED   1     /* Waiting for the reseed thread */
+#define RESEED_READY    2     /* c->reseedbuf holds the next seed */
+
+/* A per-thread keystream cache, see PRNG_output_cached() */
+typedef struct prng_cache_t {
+  struct prng_cache_t *next;
+  struct prng_cache_t **pprev;
+  prngctx_t *ctx;
+  unsigned long gen;      /* c->rekeys + forkgen when the cache was filled */
+#ifdef NO_THREADS
+  pid_t pid;
 #endif
+  int pos, len;
+  char *buf;
+} prng_cache_t;
 
 
 
 
 static void     internal_output_bytes(prngctx_t * c, char * buf, int length);
 
+/* Throws away the rest of the last block. Called around every change of
+ * key, so key material always starts on a fresh block and no keystream
+ * from the old key is handed out afterwards.
+ */
+static void
+drop_leftover(prngctx_t * c)
+{
+  memset(c->leftover, 0, sizeof(c->leftover));
+  c->num_left = 0;
+  c->lptr = c->leftover;
+}
+
+/* Installs a key drawn from the PRNG's own output */
+static void
+set_key(prngctx_t * c, char *key)
+{
+  if (c->flags & PRNG_CHACHA20)
+  {
+    memcpy(c->chachakey, key, CHACHA_KEY_LEN);
+  }
+  else
+  {
+    aes_setup((UINT8 *)key, c->cctx);
+  }
+}
+
+/* AES walks the counter space in secret steps from zero; ChaCha20 counts
+ * in ones from a secret starting point instead.
+ */
+static void
+set_counter(prngctx_t * c, uint64 *step)
+{
+  if (c->flags & PRNG_CHACHA20)
+  {
+    c->ectr[0] = step[0];
+    c->ectr[1] = step[1];
+    c->step[0] = 0;
+    c->step[1] = long_long_swap((uint64)1);
+  }
+  else
+  {
+    c->ectr[0] = 0;
+    c->ectr[1] = 0;
+    c->step[0] = step[0];
+    c->step[1] = step[1];
+  }
+}
+
 static int
 lock_memory(void *ptr, size_t size)
 {
@@ -25,49 +137,104 @@ lock_memory(void *ptr, size_t size)
 #endif
 }
 
+/*
+ * Context pools. A pool is one anonymous mapping holding n contexts, locked
+ * once when it is created, so that contexts handed out from it need no
+ * mlock() of their own and are packed into as few locked pages as their
+ * size allows. Each starts on a cache line. Every live pool is on the pools
+ * list so that PRNG_init_ex can tell a pooled context from one anywhere
+ * else.
+ */
+#define POOL_LINE       64
+#define POOL_STRIDE     ((sizeof(prngctx_t) + POOL_LINE - 1) & ~(size_t)(POOL_LINE - 1))
+#define POOL_CTX(p, i)  ((prngctx_t *)((p)->base + (size_t)(i) * POOL_STRIDE))
+
+struct prngpool_t {
+  struct prngpool_t *next;
+  char *base;             /* Context i is at POOL_CTX(p, i) */
+  size_t size;            /* Bytes mapped at base */
+  int n, nfree;
+  int *freelist;          /* Indices of the nfree unused contexts */
+  unsigned char *inuse;   /* Whether context i is handed out */
+  int locked;             /* Whether the mapping is locked in memory */
+#ifndef NO_THREADS
+  pthread_mutex_t lock;
+#endif
+};
+
+#if !defined(NO_THREADS) && !defined(WIN32)
+static pthread_mutex_t poollock = PTHREAD_MUTEX_INITIALIZER;
+#define POOL_LIST_LOCK()    pthread_mutex_lock(&poollock)
+#define POOL_LIST_UNLOCK()  pthread_mutex_unlock(&poollock)
+#else
+#define POOL_LIST_LOCK()
+#define POOL_LIST_UNLOCK()
+#endif
+
+static prngpool_t *pools;
+
+/* Whether c lies in the locked mapping of a pool */
+static int
+pool_owns(prngctx_t * c)
+{
+  prngpool_t     *p;
+  int             found = 0;
+
+  POOL_LIST_LOCK();
+  for (p = pools; p && !found; p = p->next)
+  {
+    found = p->locked && (char *)c >= p->base
+                      && (char *)c < p->base + p->size;
+  }
+  POOL_LIST_UNLOCK();
+  return found;
+}
+
 static void
 self_reseed(prngctx_t * c)
 {
-  char          new_key[UMAC_KEY_LEN];
+  char          new_key[PRNG_MAX_KEY_LEN];
   uint64          new_step[2];
-  int             i;
-  internal_output_bytes(c, new_key, UMAC_KEY_LEN);
+  drop_leftover(c);
+  internal_output_bytes(c, new_key, c->keylen);
 
-  aes_setup(new_key, c->cctx);
+  set_key(c, new_key);
   /*umac_delete(c->cctx);
   c->cctx = umac_new(new_key);*/
 
   internal_output_bytes(c, (char *)new_step, 16);
 
-  for (i = 0; i < 2; i++)
-  {
-    c->ectr[i] = 0;
-    c->step[i] = new_step[i];
-  }
+  set_counter(c, new_step);
+  drop_leftover(c);
+  c->outputblocks = 0;
+  c->stats.selfreseeds++;
+  c->rekeys++;
 }
 
-/* Precondition; seed must be (keylen+blocklen) bytes. 
+/* Precondition; seed must be PRNG_SEED_LEN bytes. 
  * We do not enforce this with checks, we just read from memory.
+ * With ChaCha20 the seed covers the first UMAC_KEY_LEN bytes of the key.
  */
 void
 PRNG_rekey(prngctx_t * c, char *seed)
 {
-  char          new_key[UMAC_KEY_LEN];
+  char          new_key[PRNG_MAX_KEY_LEN];
   uint64          new_step[2];
   uint64         *stmp;
   int             i, j;
 
   j = 0;
 
-  internal_output_bytes(c, new_key, UMAC_KEY_LEN);
+  drop_leftover(c);
+  internal_output_bytes(c, new_key, c->keylen);
   
-  for (i = 0; i < c->keylen; i++)
+  for (i = 0; i < UMAC_KEY_LEN; i++)
   {
     stmp = (uint64 *) (&seed[8 * j++]);
     new_key[i] ^= seed[j++];
   }
 
-  aes_setup(new_key, c->cctx);
+  set_key(c, new_key);
   /*umac_delete(c->cctx);
   c->cctx = umac_new(new_key); */
   internal_output_bytes(c, (char *)new_step, 16);
@@ -79,77 +246,211 @@ PRNG_rekey(prngctx_t * c, char *seed)
     new_step[i] ^= *stmp;
   }
 
-  for (i = 0; i < 2; i++)
+  set_counter(c, new_step);
+  c->step[1] |= long_long_swap((uint64) 1);
+  drop_leftover(c);
+  c->outputblocks = 0;
+  c->stats.rekeys++;
+  c->rekeys++;
+}
+
+/* The time rekey deadlines are measured in, from PRNG_CLOCK if there is one */
+static void
+deadline_clock(struct timeval *tv)
+{
+#ifdef PRNG_CLOCK
+  struct timespec ts;
+
+  if (clock_gettime(PRNG_CLOCK, &ts) == 0)
   {
-    c->ectr[i] = 0;
-    c->step[i] = new_step[i];
+    tv->tv_sec = ts.tv_sec;
+    tv->tv_usec = ts.tv_nsec / 1000;
+    return;
   }
-  c->step[1] |= long_long_swap((uint64) 1);
+#endif
+  gettimeofday(tv, 0);
 }
 
+/* Read a seed of PRNG_RESEED_LEN bytes from the entropy source into seed,
+ * in place if the source can fill a buffer. Returns 0 if none was had.
+ */
+static int
+fetch_seed(eg_t * eg, char *seed)
+{
+  char *buf;
+
+  if (eg->egfill)
+  {
+    return eg->egfill(seed, PRNG_RESEED_LEN, eg);
+  }
+  if ((buf = eg->eg(PRNG_RESEED_LEN, eg)) == NULL)
+  {
+    return 0;
+  }
+  memcpy(seed, buf, PRNG_RESEED_LEN);
+  /* Not our responsibility to dealloc buf; may be statically alloced */
+  if (eg->egfree)
+  {
+    eg->egfree(buf);
+  }
+  return 1;
+}
+
+/* Returns 0 before the rekey deadline, 1 once it has passed, and 2 once a
+ * whole further rekey period has gone by without a rekey.
+ */
 static int
 poll_rekey(prngctx_t * c)
 {
   struct timeval tv;
+  long lsec, lusec;
 
-  if (!c->eg.eg)
+  if (!c->eg.eg && !c->eg.egfill)
     return 0;
-  gettimeofday(&tv, 0);
-  if ((tv.tv_sec > c->target.tv_sec) ||
-      ((tv.tv_sec == c->target.tv_sec) && (tv.tv_usec >= c->target.tv_usec)))
+  deadline_clock(&tv);
+  if ((tv.tv_sec < c->target.tv_sec) ||
+      ((tv.tv_sec == c->target.tv_sec) && (tv.tv_usec < c->target.tv_usec)))
   {
-    return 1;
+    return 0;
+  }
+
+  lsec = tv.tv_sec - c->target.tv_sec;
+  lusec = tv.tv_usec - c->target.tv_usec;
+  if (lusec < 0)
+  {
+    lusec += 1000000;
+    --lsec;
+  }
+  if ((lsec > c->sec) || ((lsec == c->sec) && (lusec >= c->usec)))
+  {
+    return 2;
+  }
+  return 1;
+}
+
+static void
+set_target(prngctx_t * c)
+{
+  deadline_clock(&(c->target));
+  c->target.tv_sec += c->sec;
+  c->target.tv_usec += c->usec;
+  if (c->target.tv_usec >= 1000000)
+  {
+	c->target.tv_usec -= 1000000;
+	++c->target.tv_sec;
   }
-  return 0;
 }
 
 /* The secret increment is a major pain.  
  * Why can't it just be 1?
  * Counter mode seems fine w/o this secret.
  * Remember, counters are "big endian"... ie, most significant 64 bits first.
+ *
+ * Writes the n counter blocks after ctr to ctrs (two words per block, in
+ * the same layout as c->ectr) and leaves ctr at the last of them.
  */
 static void
-increment_counter(prngctx_t * c)
+step_counter(uint64 *ctr, uint64 *step, uint64 *ctrs, int n)
 {
-  uint64          old;
-  int             i, d, j;
-
-  i = 2;
-  for (j = 0; j < 2; j++)
-  {
+  uint64          hi, lo, shi, slo;
 
-    c->ectr[j] = long_long_swap(c->ectr[j]);
+  hi = long_long_swap(ctr[0]);
+  lo = long_long_swap(ctr[1]);
+  shi = long_long_swap(step[0]);
+  slo = long_long_swap(step[1]);
 
-    c->step[j] = long_long_swap(c->step[j]);
+  while (n--)
+  {
+    lo += slo;
+    hi += shi + (lo < slo);
+    *ctrs++ = long_long_swap(hi);
+    *ctrs++ = long_long_swap(lo);
   }
 
+  ctr[0] = long_long_swap(hi);
+  ctr[1] = long_long_swap(lo);
+}
+
+/* Writes nblocks blocks of keystream for the counters after ctr to out,
+ * with the cipher selected by flags.
+ */
+static void
+keystream(int flags, void *key, uint64 *ctr, uint64 *step, char *out,
+          int nblocks)
+{
+  uint64          ctrs[2 * PRNG_BATCH_BLOCKS];
+  int             n;
 
-  while (i--)
+  if (flags & PRNG_CHACHA20)
+  {
+    chacha_blocks(key, ctr, (UINT8 *)out, nblocks);
+    return;
+  }
+  while (nblocks > 0)
   {
-    old = c->ectr[i];
+    n = (nblocks < PRNG_BATCH_BLOCKS ? nblocks : PRNG_BATCH_BLOCKS);
+    step_counter(ctr, step, ctrs, n);
+    aes_blocks((UINT8 *)ctrs, (UINT8 *)out, n, key);
+    out += n * AES_BLOCK_LEN;
+    nblocks -= n;
+  }
+}
 
-    c->ectr[i] += c->step[i];
+/* Full 128-bit product of a and b */
+static void
+mul_64x64(uint64 a, uint64 b, uint64 *hi, uint64 *lo)
+{
+  uint64          a0, a1, b0, b1, p00, p01, p10, mid;
 
-    if (old > c->ectr[i])
-    {
-      d = i;
+  a0 = a & 0xffffffffULL;
+  a1 = a >> 32;
+  b0 = b & 0xffffffffULL;
+  b1 = b >> 32;
+  p00 = a0 * b0;
+  p01 = a0 * b1;
+  p10 = a1 * b0;
+  mid = (p00 >> 32) + (p01 & 0xffffffffULL) + (p10 & 0xffffffffULL);
+  *lo = (mid << 32) | (p00 & 0xffffffffULL);
+  *hi = a1 * b1 + (p01 >> 32) + (p10 >> 32) + (mid >> 32);
+}
 
-      while (d--)
-      {
-	if (++c->ectr[d])
-	  break;
-      }
-    }
-  }
+/* Moves c->ectr on by the 128-bit number of steps nhi:nlo, as if that many
+ * counter blocks had been generated.
+ */
+static void
+advance_counter(prngctx_t * c, uint64 nhi, uint64 nlo)
+{
+  uint64          hi, lo, shi, slo, phi, plo;
 
-  for (j = 0; j < 2; j++)
-  {
+  hi = long_long_swap(c->ectr[0]);
+  lo = long_long_swap(c->ectr[1]);
+  shi = long_long_swap(c->step[0]);
+  slo = long_long_swap(c->step[1]);
 
-    c->ectr[j] = long_long_swap(c->ectr[j]);
-    c->step[j] = long_long_swap(c->step[j]);
-  }
+  mul_64x64(slo, nlo, &phi, &plo);
+  phi += shi * nlo + slo * nhi;
+  lo += plo;
+  hi += phi + (lo < plo);
 
+  c->ectr[0] = long_long_swap(hi);
+  c->ectr[1] = long_long_swap(lo);
+}
 
+/* Reseed policy: every key produces at most KEY_BLOCKS cipher blocks,
+ * however they are split between calls, and is then replaced by
+ * self_reseed() from its own output.
+ */
+static void
+count_blocks(prngctx_t * c, int nblocks)
+{
+  c->stats.blocks += nblocks;
+  c->outputblocks += nblocks;
+  if (c->outputblocks >= KEY_BLOCKS(c)) 
+  {
+    /* self_reseed draws two blocks itself; don't let them recurse */
+    c->outputblocks = 0;
+    self_reseed(c);
+  }
 }
 
 static void
@@ -158,12 +459,11 @@ internal_output_bytes(prngctx_t * c, char *out, int howmuch)
   
   int frombuf = 0;
   int outidx = 0;
-  char outtmp[AES_BLOCK_LEN] = {0};
-  int leftover = 0;
+  int nblocks;
+  char outtmp[PRNG_MAX_BLOCK_LEN] = {0};
   
   if (c->num_left > 0)
   {
-    int ii; 
     if (c->num_left >= howmuch)
     {
       frombuf = howmuch; 
@@ -181,147 +481,723 @@ internal_output_bytes(prngctx_t * c, char *out, int howmuch)
       c->lptr = c->leftover;
     }
   }
-  while (howmuch > 0)
+
+  /* Whole blocks are encrypted in batches straight into the caller's buffer */
+  while (howmuch >= c->blocklen)
+  {
+    nblocks = howmuch / c->blocklen;
+    if (nblocks > PRNG_BATCH_BLOCKS)
+    {
+      nblocks = PRNG_BATCH_BLOCKS;
+    }
+    if (nblocks > KEY_BLOCKS(c) - c->outputblocks)
+    {
+      nblocks = KEY_BLOCKS(c) - c->outputblocks;
+    }
+    keystream(c->flags, CIPHER_KEY(c), c->ectr, c->step, &out[outidx],
+              nblocks);
+    c->nonce += nblocks;
+
+    outidx += nblocks * c->blocklen;
+    howmuch -= nblocks * c->blocklen;
+    count_blocks(c, nblocks);
+  }
+
+  /* A ragged tail keeps the rest of its block for the next call */
+  if (howmuch > 0)
   {
-    increment_counter(c);
+    keystream(c->flags, CIPHER_KEY(c), c->ectr, c->step, outtmp, 1);
     c->nonce++;
 
-    aes((char *)c->ectr, outtmp, c->cctx);
-    /*umac(c->cctx, (char *)c->ectr, 16, outtmp, (char *)&c->nonce);
-    umac_reset(c->cctx);*/
+    memcpy(&out[outidx], outtmp, howmuch);
+
+    c->num_left = (unsigned short)(c->blocklen - howmuch);
+    memcpy(c->leftover, &outtmp[howmuch], c->num_left);
+    c->lptr = c->leftover;
+    count_blocks(c, 1);
+  }     
+  return;
+}
+
+#ifdef RESEED_THREAD
+/* Background reseeding.
+ *
+ * Contexts created with PRNG_ASYNC_RESEED never call their entropy source
+ * from PRNG_output. Right after every rekey the context is queued for a
+ * single library-owned thread, which fetches the next seed from the
+ * context's entropy source into c->reseedbuf. When the rekey deadline passes,
+ * PRNG_output only has to apply the buffered seed.
+ *
+ * c->reseedstate, c->reseedbuf and c->reseednext belong to reseedlock
+ * rather than the context lock, which single owner contexts never take.
+ */
+static pthread_mutex_t reseedlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reseedcond = PTHREAD_COND_INITIALIZER;
+static prngctx_t *reseedq;          /* Contexts waiting for a seed */
+static prngctx_t *reseedbusy;       /* Context being served right now */
+static int reseedrunning;
 
-    if (howmuch > AES_BLOCK_LEN)
+static void *
+reseed_thread(void *arg)
+{
+  prngctx_t *c;
+  int ok;
+
+  pthread_mutex_lock(&reseedlock);
+  for (;;)
+  {
+    while ((c = reseedq) == NULL)
     {
-      frombuf = AES_BLOCK_LEN;
-    } else {
-      frombuf = howmuch;
-      leftover = AES_BLOCK_LEN - howmuch;
+      pthread_cond_wait(&reseedcond, &reseedlock);
     }
+    reseedq = c->reseednext;
+    reseedbusy = c;
+    pthread_mutex_unlock(&reseedlock);
 
-      
-    memcpy(&out[outidx], outtmp, frombuf);
+    /* Nothing else touches c->reseedbuf while the context is queued */
+    ok = fetch_seed(&(c->eg), c->reseedbuf);
 
-    outidx += frombuf;
-    howmuch -= frombuf;
+    pthread_mutex_lock(&reseedlock);
+    if (ok)
+    {
+      c->reseedstate = RESEED_READY;
+    }
+    else
+    {
+      /* The next deadline queues it again */
+      c->reseedstate = RESEED_IDLE;
+    }
+    reseedbusy = NULL;
+    pthread_cond_broadcast(&reseedcond);
   }
- 
+  return NULL;
+}
+
+/* Queue c for a seed unless one is already on its way, starting the thread
+ * if needed. The caller holds reseedlock.
+ */
+static void
+reseed_queue(prngctx_t * c)
+{
+  pthread_attr_t attr;
+  pthread_t tid;
 
-  if (leftover)
+  if (c->reseedstate == RESEED_IDLE)
   {
-    int i;
-    memcpy(c->leftover, &outtmp[AES_BLOCK_LEN-leftover], leftover);
-    c->num_left = (unsigned short)leftover;
-    c->lptr = c->leftover;
-  }     
-    
+    c->reseedstate = RESEED_QUEUED;
+    c->reseednext = reseedq;
+    reseedq = c;
+    pthread_cond_broadcast(&reseedcond);
+  }
+  if (!reseedrunning)
+  {
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    reseedrunning = !pthread_create(&tid, &attr, reseed_thread, NULL);
+    pthread_attr_destroy(&attr);
+  }
+}
 
+static void
+reseed_request(prngctx_t * c)
+{
+  pthread_mutex_lock(&reseedlock);
+  reseed_queue(c);
+  pthread_mutex_unlock(&reseedlock);
+}
 
-  
-  c->outputblocks++;
-  if(c->outputblocks >= MAXBLOCKRESEED) 
+/* Copy the buffered seed to seed, if it has arrived, and queue the fetch
+ * of the one after it. Returns 0 while the fetch is still outstanding.
+ */
+static int
+reseed_take(prngctx_t * c, char *seed)
+{
+  int ok = 0;
+
+  pthread_mutex_lock(&reseedlock);
+  if (c->reseedstate == RESEED_READY)
   {
-    c->outputblocks = 0;
-    self_reseed(c);
+    memcpy(seed, c->reseedbuf, PRNG_RESEED_LEN);
+    memset(c->reseedbuf, 0, PRNG_RESEED_LEN);
+    c->reseedstate = RESEED_IDLE;
+    ok = 1;
   }
-  return;
+  reseed_queue(c);
+  pthread_mutex_unlock(&reseedlock);
+  return ok;
 }
 
-void
-PRNG_output(prngctx_t * c, char *buf, uint64 size)
+/* Make sure the reseed thread no longer refers to c */
+static void
+reseed_cancel(prngctx_t * c)
 {
+  prngctx_t **pp;
 
-  pthread_mutex_lock(&liblock);
+  pthread_mutex_lock(&reseedlock);
+  for (pp = &reseedq; *pp != NULL; pp = &((*pp)->reseednext))
+  {
+    if (*pp == c)
+    {
+      *pp = c->reseednext;
+      break;
+    }
+  }
+  while (reseedbusy == c)
+  {
+    pthread_cond_wait(&reseedcond, &reseedlock);
+  }
+  memset(c->reseedbuf, 0, PRNG_RESEED_LEN);
+  c->reseedstate = RESEED_IDLE;
+  pthread_mutex_unlock(&reseedlock);
+}
 
-#ifdef THREAD_USES_NEWPID
-#ifndef NO_THREADS
-  if ((forkedat.tv_sec > c->seedtime.tv_sec) || ((forkedat.tv_sec == c->seedtime
-.tv_sec) && (forkedat.tv_usec > c->seedtime.tv_usec)))
+/* The reseed thread does not survive fork(). The context it was serving
+ * goes back on the queue, and the first request in the child starts a new
+ * thread.
+ */
+static void
+reseed_atfork_prepare(void)
+{
+  pthread_mutex_lock(&reseedlock);
+}
+
+static void
+reseed_atfork_parent(void)
+{
+  pthread_mutex_unlock(&reseedlock);
+}
+
+static void
+reseed_atfork_child(void)
+{
+  if (reseedbusy != NULL)
+  {
+    reseedbusy->reseednext = reseedq;
+    reseedq = reseedbusy;
+    reseedbusy = NULL;
+  }
+  reseedrunning = 0;
+  pthread_mutex_init(&reseedlock, NULL);
+  pthread_cond_init(&reseedcond, NULL);
+}
+#endif /* RESEED_THREAD */
+
+static void
+check_fork(prngctx_t * c)
+{
+  /* We've forked, let's reseed. With threads, forks are counted by an
+   * atfork handler so no system call is needed here.
+   */
+#if !defined(NO_THREADS) && !defined(WIN32)
+  if (c->forkgen != forkgen)
   {
     self_reseed(c);
-    gettimeofday(&(c->seedtime), 0);
+    c->forkgen = forkgen;
   }
-#endif
 #else
   if (c->mypid != getpid())
   {
-  /* We've forked, let's reseed */
     self_reseed(c);
     c->mypid = getpid();
   }
-
 #endif
+}
+
+static void
+output_bytes(prngctx_t * c, char *buf, uint64 size)
+{
+  int n;
 
+  /* internal_output_bytes takes an int length, so huge requests go in
+   * pieces. Reseeding is accounted per block in there. The leftover block
+   * is used up first so that only the last piece can end mid-block.
+   */
+  n = (size < c->num_left ? (int)size : c->num_left);
+  internal_output_bytes(c, buf, n);
+  buf += n;
+  size -= n;
   while (size > GATE_SIZE)
   {
     internal_output_bytes(c, buf, GATE_SIZE);
     buf += GATE_SIZE;
     size -= GATE_SIZE;
-    self_reseed(c);
   }
   internal_output_bytes(c, buf, (int)size);
+}
+
+static void
+check_rekey(prngctx_t * c)
+{
+  char seed[PRNG_RESEED_LEN];
+  int due, ok;
+
+  if ((due = poll_rekey(c)) != 0)
+  {
+    ok = 0;
+#ifdef RESEED_THREAD
+    if (c->flags & PRNG_ASYNC_RESEED)
+    {
+      ok = reseed_take(c, seed);
+    }
+    /* A seed a whole period overdue means the reseed thread is stuck, so
+     * fall back to fetching it here.
+     */
+    if (!ok && (due == 2 || !(c->flags & PRNG_ASYNC_RESEED)))
+#endif
+    {
+      ok = fetch_seed(&(c->eg), seed);
+      set_target(c);
+    }
+
+    if (ok)
+    {
+      PRNG_rekey(c, seed);
+      memset(seed, 0, sizeof(seed));
+      set_target(c);
+    }
+  }
+}
+
+/* PRNG_output, returning the key generation (c->rekeys + forkgen) the
+ * bytes were made under, as read under the same lock.
+ */
+static unsigned long
+output_gen(prngctx_t * c, char *buf, uint64 size)
+{
+  unsigned long gen;
+
+  PRNG_LOCK(c);
+  check_fork(c);
+  gen = c->rekeys + forkgen;
+  c->stats.bytes += size;
+  output_bytes(c, buf, size);
   /*self_reseed(c); */
-  if (poll_rekey(c))
+  check_rekey(c);
+  PRNG_UNLOCK(c);
+  return gen;
+}
+
+void
+PRNG_output(prngctx_t * c, char *buf, uint64 size)
+{
+  output_gen(c, buf, size);
+}
+
+/* Scatter fills. The destinations get one contiguous run of keystream,
+ * the same bytes a single PRNG_output for their total length would have
+ * produced, with the lock, fork check and rekey check paid once. Small
+ * destinations are served from a run generated IOV_RUN bytes at a time on
+ * the stack; any that could take a whole run are generated in place. The
+ * runs are never longer than what is left to hand out, so no keystream is
+ * skipped.
+ */
+#define IOV_RUN 4096
+
+void
+PRNG_output_iov(prngctx_t * c, const struct iovec *iov, int cnt)
+{
+  char run[IOV_RUN];
+  uint64 total = 0, len;
+  char *dst;
+  int i, n, pos = 0, avail = 0, used = 0;
+
+  for (i = 0; i < cnt; i++)
   {
-    buf = c->eg.eg(c->keylen * 8 + c->blocklen * 8, &(c->eg));
+    total += iov[i].iov_len;
+  }
 
-    if (buf)
+  PRNG_LOCK(c);
+  check_fork(c);
+  c->stats.bytes += total;
+  for (i = 0; i < cnt; i++)
+  {
+    dst = (char *)iov[i].iov_base;
+    len = iov[i].iov_len;
+    while (len > 0)
     {
-      /* Not our responsibility to dealloc buf; 
-       * may be statically alloced 
-       */
-      PRNG_rekey(c, buf);
-      if (c->eg.egfree) 
+      if (avail == 0 && len >= IOV_RUN)
       {
-        c->eg.egfree(buf);
+        output_bytes(c, dst, len);
+        total -= len;
+        break;
       }
+      if (avail == 0)
+      {
+        avail = (total < IOV_RUN ? (int)total : IOV_RUN);
+        output_bytes(c, run, avail);
+        pos = 0;
+        if (avail > used)
+        {
+          used = avail;
+        }
+      }
+      n = (len < (uint64)avail ? (int)len : avail);
+      memcpy(dst, &run[pos], n);
+      pos += n;
+      avail -= n;
+      dst += n;
+      len -= n;
+      total -= n;
+    }
+  }
+  check_rekey(c);
+  PRNG_UNLOCK(c);
+  memset(run, 0, used);
+}
+
+#if !defined(NO_THREADS) && !defined(WIN32)
+/* Parallel fills.
+ *
+ * The keystream for the whole request is laid out under the context lock
+ * exactly as PRNG_output would produce it: the counter range for each key
+ * is cut into jobs, each carrying its start counter and the index of a
+ * copy of the key schedule, and the context is moved past them, self
+ * reseeding every KEY_BLOCKS(c) blocks (GATE_SIZE bytes) as usual. The
+ * lock is dropped before any of it is encrypted; the caller and
+ * nthreads - 1 helper threads then work through the jobs.
+ */
+#define PARALLEL_MIN_BYTES    (1 << 20)   /* Smaller requests stay serial */
+#define PARALLEL_JOB_BYTES    (1 << 20)   /* Output per job */
+#define PARALLEL_MAX_THREADS  64
+
+typedef struct prng_job_t {
+  char *out;
+  int nblocks;
+  int key;                /* Index into prng_fill_t.keys */
+  uint64 ctr[2];
+  uint64 step[2];
+} prng_job_t;
+
+typedef union prng_key_t {
+  aes_int_key aes;
+  UINT8 chacha[CHACHA_KEY_LEN];
+} prng_key_t;
+
+typedef struct prng_fill_t {
+  pthread_mutex_t lock;
+  int flags;              /* Cipher selection, from the context */
+  int blocklen;
+  prng_key_t *keys;
+  prng_job_t *jobs;
+  int njobs, next;
+} prng_fill_t;
+
+static void *
+fill_worker(void *arg)
+{
+  prng_fill_t *f = (prng_fill_t *)arg;
+  prng_job_t *j;
+
+  for (;;)
+  {
+    pthread_mutex_lock(&(f->lock));
+    j = (f->next < f->njobs ? &(f->jobs[f->next++]) : NULL);
+    pthread_mutex_unlock(&(f->lock));
+    if (j == NULL)
+    {
+      break;
     }
+
+    keystream(f->flags, &(f->keys[j->key]), j->ctr, j->step, j->out,
+              j->nblocks);
   }
-  pthread_mutex_unlock(&liblock);
+  return NULL;
 }
 
+void
+PRNG_output_parallel(prngctx_t * c, char *buf, uint64 size, int nthreads)
+{
+  prng_fill_t f;
+  prng_job_t *j;
+  pthread_t tid[PARALLEL_MAX_THREADS - 1];
+  uint64 blocks, seg, done;
+  int nkeys, maxkeys, maxjobs, jobblocks, started, n, i;
+
+  if (nthreads <= 1 || size < PARALLEL_MIN_BYTES)
+  {
+    PRNG_output(c, buf, size);
+    return;
+  }
+  if (nthreads > PARALLEL_MAX_THREADS)
+  {
+    nthreads = PARALLEL_MAX_THREADS;
+  }
+
+  PRNG_LOCK(c);
+  check_fork(c);
+  c->stats.bytes += size;
 
+  /* Finish off the block left over from the last request */
+  n = c->num_left;
+  internal_output_bytes(c, buf, n);
+  buf += n;
+  size -= n;
+
+  f.flags = c->flags;
+  f.blocklen = c->blocklen;
+  jobblocks = PARALLEL_JOB_BYTES / c->blocklen;
+  blocks = size / c->blocklen;
+  maxkeys = (int)((blocks + c->outputblocks) / KEY_BLOCKS(c)) + 1;
+  maxjobs = (int)(blocks / jobblocks) + maxkeys;
+  f.keys = (prng_key_t *)malloc(maxkeys * sizeof(prng_key_t));
+  f.jobs = (prng_job_t *)malloc(maxjobs * sizeof(prng_job_t));
+  if (f.keys == NULL || f.jobs == NULL)
+  {
+    free(f.keys);
+    free(f.jobs);
+    output_bytes(c, buf, size);
+    check_rekey(c);
+    PRNG_UNLOCK(c);
+    return;
+  }
+
+  nkeys = 0;
+  f.njobs = 0;
+  while (blocks > 0)
+  {
+    seg = KEY_BLOCKS(c) - c->outputblocks;
+    if (seg > blocks)
+    {
+      seg = blocks;
+    }
+    memcpy(&(f.keys[nkeys]), CIPHER_KEY(c), CIPHER_KEY_LEN(c));
+    for (done = 0; done < seg; done += n)
+    {
+      n = (seg - done < jobblocks ? (int)(seg - done) : jobblocks);
+      j = &(f.jobs[f.njobs++]);
+      j->out = buf;
+      j->nblocks = n;
+      j->key = nkeys;
+      memcpy(j->ctr, c->ectr, sizeof(j->ctr));
+      memcpy(j->step, c->step, sizeof(j->step));
+      advance_counter(c, 0, n);
+      buf += (uint64)n * c->blocklen;
+    }
+    nkeys++;
+    c->nonce += seg;
+    blocks -= seg;
+    count_blocks(c, (int)seg);
+  }
+  internal_output_bytes(c, buf, (int)(size % c->blocklen));
+  check_rekey(c);
+  PRNG_UNLOCK(c);
+
+  f.next = 0;
+  pthread_mutex_init(&(f.lock), NULL);
+  for (started = 0; started < nthreads - 1; started++)
+  {
+    if (pthread_create(&tid[started], NULL, fill_worker, &f))
+    {
+      break;
+    }
+  }
+  fill_worker(&f);
+  for (i = 0; i < started; i++)
+  {
+    pthread_join(tid[i], NULL);
+  }
+  pthread_mutex_destroy(&(f.lock));
+
+  memset(f.keys, 0, maxkeys * sizeof(prng_key_t));
+  memset(f.jobs, 0, maxjobs * sizeof(prng_job_t));
+  free(f.keys);
+  free(f.jobs);
+}
+#else
+void
+PRNG_output_parallel(prngctx_t * c, char *buf, uint64 size, int nthreads)
+{
+  PRNG_output(c, buf, size);
+}
+#endif
+
+#if !defined(NO_THREADS) && !defined(WIN32)
 static void
-child_forked()
+forkgen_child(void)
 {
+  forkgen++;
+}
+
+static void
+forkgen_register(void)
+{
+  pthread_atfork(NULL, NULL, forkgen_child);
+  pthread_atfork(reseed_atfork_prepare, reseed_atfork_parent,
+                 reseed_atfork_child);
+}
+#endif
+
+static void
+cache_free(prng_cache_t *pc)
+{
+  memset(pc->buf, 0, pc->len);
+  free(pc);
+}
+
 #ifndef NO_THREADS
-  gettimeofday(&forkedat, 0);
+/* Runs as a thread holding a cache exits */
+static void
+cache_thread_exit(void *arg)
+{
+  prng_cache_t *pc = (prng_cache_t *)arg;
+  prngctx_t *c = pc->ctx;
+
+  PRNG_LOCK(c);
+  if ((*pc->pprev = pc->next) != NULL)
+  {
+    pc->next->pprev = pc->pprev;
+  }
+  PRNG_UNLOCK(c);
+  cache_free(pc);
+}
+#endif
+
+/* Wipe and free every thread's cache. The caller holds the context lock. */
+static void
+cache_release_all(prngctx_t * c)
+{
+  prng_cache_t *pc;
+
+  if (!c->cachesize)
+  {
+    return;
+  }
+  while ((pc = (prng_cache_t *)c->caches) != NULL)
+  {
+    c->caches = pc->next;
+    cache_free(pc);
+  }
+  c->cachesize = 0;
+#ifndef NO_THREADS
+  pthread_key_delete(c->cachekey);
 #endif
 }
 
-/* keysize and blocksize are fixed at compile time by the umac type */
+/* Give each thread using this context a private buffer of size bytes of
+ * keystream, from which PRNG_output_cached() serves small requests without
+ * taking the context lock. size 0 turns the caches off. This must be called
+ * before the context is shared between threads.
+ */
 int
-PRNG_init(prngctx_t * c, char *seed, 
-	  long sec, long usec)
+PRNG_setcache(prngctx_t * c, int size)
 {
-  int             i;
-  char            initial_key[UMAC_KEY_LEN] = { 0 };
-  int		  bytes_over;
+  int ret = 0;
+
+  PRNG_LOCK(c);
+  cache_release_all(c);
+  if (size > 0)
+  {
+#ifndef NO_THREADS
+    if (pthread_key_create(&(c->cachekey), cache_thread_exit))
+    {
+      ret = -1;
+    }
+    else
+#endif
+    {
+      c->cachesize = size;
+    }
+  }
+  PRNG_UNLOCK(c);
+  return ret;
+}
+
+/* Copy size bytes of keystream from the calling thread's cache, refilling
+ * it in one PRNG_output call when it runs dry. The cache is discarded
+ * whenever the context has been rekeyed or the process has forked since it
+ * was filled, so cached bytes are never handed out twice or across keys.
+ */
+void
+PRNG_output_cached(prngctx_t * c, char *buf, int size)
+{
+  prng_cache_t *pc;
+
+  if (size <= 0)
+  {
+    return;
+  }
+  if (!c->cachesize || size > c->cachesize)
+  {
+    PRNG_output(c, buf, size);
+    return;
+  }
 
-#ifdef WIN32
-  if (!liblock)
-    liblock = CreateMutex(NULL, FALSE, NULL);
+#ifndef NO_THREADS
+  pc = (prng_cache_t *)pthread_getspecific(c->cachekey);
+#else
+  pc = (prng_cache_t *)c->caches;
 #endif
+  if (pc == NULL)
+  {
+    if ((pc = malloc(sizeof(prng_cache_t) + c->cachesize)) == NULL)
+    {
+      PRNG_output(c, buf, size);
+      return;
+    }
+    pc->ctx = c;
+    pc->buf = (char *)(pc + 1);
+    pc->len = c->cachesize;
+    pc->pos = pc->len;
+    pc->gen = 0;
+    PRNG_LOCK(c);
+    if ((pc->next = (prng_cache_t *)c->caches) != NULL)
+    {
+      pc->next->pprev = &(pc->next);
+    }
+    pc->pprev = (prng_cache_t **)&(c->caches);
+    c->caches = pc;
+    PRNG_UNLOCK(c);
+#ifndef NO_THREADS
+    pthread_setspecific(c->cachekey, pc);
+#endif
+  }
 
-  if (!lock_memory(c, sizeof(prngctx_t)))
+  if (pc->gen != c->rekeys + forkgen
+#ifdef NO_THREADS
+      || pc->pid != getpid()
+#endif
+      || pc->len - pc->pos < size)
   {
-    fprintf(stderr, "Warning: Using insecure memory.\n");
+    memset(pc->buf, 0, pc->len);
+    pc->gen = output_gen(c, pc->buf, pc->len);
+#ifdef NO_THREADS
+    pc->pid = getpid();
+#endif
+    pc->pos = 0;
   }
-  pthread_mutex_lock(&liblock);
 
-  gettimeofday(&(c->target), 0);
-  c->nonce = c->target.tv_sec;
+  /* Consumed bytes are wiped so they cannot be recovered later */
+  memcpy(buf, &(pc->buf[pc->pos]), size);
+  memset(&(pc->buf[pc->pos]), 0, size);
+  pc->pos += size;
+}
 
-  c->keylen = UMAC_KEY_LEN; 
-  c->blocklen = AES_BLOCK_LEN;
-  c->outputblocks = 0;
-  aes_setup(initial_key, c->cctx);
 
-  c->rectr = malloc((sizeof(uint64)*2)+16);
-  bytes_over = (int)c->rectr & (16 - 1);
-  if (bytes_over != 0)
-     c->ectr = c->rectr + (16 - bytes_over);
+/* keysize and blocksize are fixed at compile time by the umac type */
+static void
+prng_setup(prngctx_t * c, char *seed, 
+	   long sec, long usec)
+{
+  int             i;
+  char            initial_key[PRNG_MAX_KEY_LEN] = { 0 };
+  struct timeval  tv;
+
+  gettimeofday(&tv, 0);
+  c->nonce = tv.tv_sec;
+
+  if (c->flags & PRNG_CHACHA20)
+  {
+    c->keylen = CHACHA_KEY_LEN;
+    c->blocklen = CHACHA_BLOCK_LEN;
+  }
   else
-     c->ectr = c->rectr;
+  {
+    c->keylen = UMAC_KEY_LEN; 
+    c->blocklen = AES_BLOCK_LEN;
+  }
+  c->outputblocks = 0;
+  memset(&(c->stats), 0, sizeof(c->stats));
+  set_key(c, initial_key);
 
   for (i = 0; i < 2; i++)
   {
@@ -341,32 +1217,287 @@ PRNG_init(prngctx_t * c, char *seed,
   }
 
 
-#ifdef THREAD_USES_NEWPID
-#ifndef NO_THREADS
-    pthread_atfork(NULL, NULL, child_forked);
-    gettimeofday(&(c->seedtime), 0);
-#endif
+#if !defined(NO_THREADS) && !defined(WIN32)
+  c->forkgen = forkgen;
 #else
-    c->mypid = getpid();
+  c->mypid = getpid();
 #endif
 
   PRNG_rekey(c, seed);
-  gettimeofday(&(c->target), 0);
-  c->target.tv_sec += c->sec;
-  c->target.tv_usec += c->usec;
-  if (c->target.tv_usec >= 1000000)
+  set_target(c);
+}
+
+int
+PRNG_init_ex(prngctx_t * c, char *seed, 
+	     long sec, long usec, int flags)
+{
+  if (!pool_owns(c) && !lock_memory(c, sizeof(prngctx_t)))
   {
-	c->target.tv_usec -= 1000000;
-	++c->target.tv_sec;
+    fprintf(stderr, "Warning: Using insecure memory.\n");
+  }
+
+  c->flags = flags & ~PRNG_INITIALIZED;
+  c->rekeys = 0;
+  c->cachesize = 0;
+  c->caches = NULL;
+  c->reseedstate = RESEED_IDLE;
+  pthread_mutex_init(&(c->lock), NULL);
+#if !defined(NO_THREADS) && !defined(WIN32)
+  pthread_once(&forkgen_once, forkgen_register);
+#endif
+  prng_setup(c, seed, sec, usec);
+#ifdef RESEED_THREAD
+  if ((flags & PRNG_ASYNC_RESEED) && (c->eg.eg || c->eg.egfill))
+  {
+    reseed_request(c);
   }
-  pthread_mutex_unlock(&liblock);
+#endif
+  c->flags |= PRNG_INITIALIZED;
+  return 0;
+}
+
+int
+PRNG_init(prngctx_t * c, char *seed, 
+	  long sec, long usec)
+{
+  return PRNG_init_ex(c, seed, sec, usec, 0);
+}
+
+void
+PRNG_stats(prngctx_t * c, prngstats_t *st)
+{
+  PRNG_LOCK(c);
+  memcpy(st, &(c->stats), sizeof(prngstats_t));
+  PRNG_UNLOCK(c);
+}
+
+void
+PRNG_skip(prngctx_t * c, uint64 blocks)
+{
+  PRNG_LOCK(c);
+  drop_leftover(c);
+  advance_counter(c, 0, blocks);
+  c->nonce += blocks;
+  PRNG_UNLOCK(c);
+}
+
+/* The children share one key and step with the parent, and each owns a
+ * 2^64 block slice of the counter space after the parent's: child i starts
+ * (i + 1) * 2^64 steps ahead. An odd step is a permutation of the counter
+ * space, so the slices cannot meet; the step is made odd here for that.
+ * Self reseeds happen long before a stream leaves its slice, and the parent
+ * moves to a fresh key of its own right after the split.
+ */
+int
+PRNG_split(prngctx_t * c, int n, prngctx_t *children, int flags)
+{
+  char            seed[PRNG_SEED_LEN] = { 0 };
+  uint64          lo;
+  int             i;
+
+  if (n < 0 || (n > 0 && children == NULL))
+  {
+    return -1;
+  }
+
+  /* Children are keyed from the parent, never from the entropy source, so
+   * they get no source and no paths; PRNG_destroy releases them fully.
+   */
+  for (i = 0; i < n; i++)
+  {
+    memset(&(children[i].eg), 0, sizeof(eg_t));
+    if (PRNG_init_ex(&children[i], seed, c->sec, c->usec,
+                     (flags & ~(PRNG_ASYNC_RESEED | PRNG_CHACHA20))
+                     | (c->flags & PRNG_CHACHA20)))
+    {
+      while (i--)
+      {
+        PRNG_destroy(&children[i]);
+      }
+      return -1;
+    }
+  }
+
+  PRNG_LOCK(c);
+  lo = long_long_swap(c->step[1]);
+  c->step[1] = long_long_swap(lo | 1);
+  for (i = 0; i < n; i++)
+  {
+    memcpy(children[i].cctx, c->cctx, sizeof(c->cctx));
+    memcpy(children[i].chachakey, c->chachakey, sizeof(c->chachakey));
+    children[i].step[0] = c->step[0];
+    children[i].step[1] = c->step[1];
+    children[i].ectr[0] = c->ectr[0];
+    children[i].ectr[1] = c->ectr[1];
+    advance_counter(&children[i], (uint64)i + 1, 0);
+  }
+  self_reseed(c);
+  PRNG_UNLOCK(c);
   return 0;
 }
 
 void
 PRNG_destroy(prngctx_t * c)
 {
-  char            seed[UMAC_KEY_LEN] = { 0 };
+  char            seed[PRNG_SEED_LEN] = { 0 };
 
-  PRNG_init(c, seed, 0, 0);
+#ifdef RESEED_THREAD
+  reseed_cancel(c);
+#endif
+  PRNG_LOCK(c);
+  cache_release_all(c);
+  prng_setup(c, seed, 0, 0);
+  PRNG_UNLOCK(c);
+  pthread_mutex_destroy(&(c->lock));
+}
+
+/* Map and lock room for n contexts. The contexts are handed out zeroed by
+ * PRNG_pool_get and initialized as usual. Returns NULL if the memory
+ * cannot be mapped; failing to lock it only draws a warning, as for a
+ * single context.
+ */
+prngpool_t *
+PRNG_pool_new(int n)
+{
+  prngpool_t     *p;
+  int             i;
+
+  if (n <= 0 || (size_t)n > ((size_t)-1) / POOL_STRIDE)
+  {
+    return NULL;
+  }
+  if (!(p = (prngpool_t *)calloc(1, sizeof(prngpool_t))))
+  {
+    return NULL;
+  }
+  p->n = n;
+  p->size = (size_t)n * POOL_STRIDE;
+  p->freelist = (int *)malloc(n * sizeof(int));
+  p->inuse = (unsigned char *)calloc(n, 1);
+  if (!p->freelist || !p->inuse)
+  {
+    free(p->freelist);
+    free(p->inuse);
+    free(p);
+    return NULL;
+  }
+#ifndef WIN32
+  p->base = (char *)mmap(NULL, p->size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p->base == (char *)MAP_FAILED)
+  {
+    p->base = NULL;
+  }
+#else
+  p->base = (char *)VirtualAlloc(NULL, p->size, MEM_COMMIT | MEM_RESERVE,
+                                 PAGE_READWRITE);
+#endif
+  if (!p->base)
+  {
+    free(p->freelist);
+    free(p->inuse);
+    free(p);
+    return NULL;
+  }
+
+#ifdef MADV_DONTDUMP
+  madvise(p->base, p->size, MADV_DONTDUMP);
+#endif
+  p->locked = lock_memory(p->base, p->size);
+  if (!p->locked)
+  {
+    fprintf(stderr, "Warning: Using insecure memory.\n");
+  }
+
+  /* Hand out the lowest addresses first */
+  for (i = 0; i < n; i++)
+  {
+    p->freelist[i] = n - 1 - i;
+  }
+  p->nfree = n;
+  pthread_mutex_init(&(p->lock), NULL);
+
+  POOL_LIST_LOCK();
+  p->next = pools;
+  pools = p;
+  POOL_LIST_UNLOCK();
+  return p;
+}
+
+/* A zeroed context from p, or NULL if all of them are in use */
+prngctx_t *
+PRNG_pool_get(prngpool_t * p)
+{
+  prngctx_t      *c = NULL;
+
+  pthread_mutex_lock(&(p->lock));
+  if (p->nfree > 0)
+  {
+    p->nfree--;
+    p->inuse[p->freelist[p->nfree]] = 1;
+    c = POOL_CTX(p, p->freelist[p->nfree]);
+  }
+  pthread_mutex_unlock(&(p->lock));
+  return c;
+}
+
+/* Wipe c, which must already be destroyed, and give it back to p. A
+ * context that is not from p, or is not handed out, is ignored.
+ */
+void
+PRNG_pool_put(prngpool_t * p, prngctx_t * c)
+{
+  size_t          off = (char *)c - p->base;
+  int             i;
+
+  if ((char *)c < p->base || off >= p->size || off % POOL_STRIDE)
+  {
+    return;
+  }
+  i = (int)(off / POOL_STRIDE);
+  pthread_mutex_lock(&(p->lock));
+  if (p->inuse[i] && p->nfree < p->n)
+  {
+    memset(c, 0, sizeof(prngctx_t));
+    p->inuse[i] = 0;
+    p->freelist[p->nfree++] = i;
+  }
+  pthread_mutex_unlock(&(p->lock));
+}
+
+/* Wipe and unmap p. Its contexts must no longer be in use. */
+void
+PRNG_pool_free(prngpool_t * p)
+{
+  prngpool_t    **pp;
+
+  POOL_LIST_LOCK();
+  for (pp = &pools; *pp; pp = &((*pp)->next))
+  {
+    if (*pp == p)
+    {
+      *pp = p->next;
+      break;
+    }
+  }
+  POOL_LIST_UNLOCK();
+
+  memset(p->base, 0, p->size);
+#ifndef WIN32
+  if (p->locked)
+  {
+    munlock(p->base, p->size);
+  }
+  munmap(p->base, p->size);
+#else
+  if (p->locked)
+  {
+    VirtualUnlock(p->base, p->size);
+  }
+  VirtualFree(p->base, 0, MEM_RELEASE);
+#endif
+  pthread_mutex_destroy(&(p->lock));
+  free(p->freelist);
+  free(p->inuse);
+  free(p);
 }
@@ -0,0 +1,800 @@
+/* Throughput benchmarks for the egads PRNG library.
+ *
+ * usage: randlib-bench [test ...]
+ *
+ * With no arguments every test is run. The contexts are seeded from a fixed
+ * buffer rather than the entropy daemon, so the numbers are reproducible and
+ * no egads server needs to be running.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <pthread.h>
+
+#include "egads.h"
+#include "umac.h"
+#include "chacha.h"
+
+#define MAX_THREADS     32
+#define CONTENTION_OPS  200000
+#define CONTENTION_LEN  16
+#define SMALLDRAW_OPS   2000000
+#define RESEED_BYTES    (64 << 20)
+#define PARALLEL_BYTES  (256 << 20)
+#define CIPHER_BYTES    (256 << 20)
+#define RANGE_VALUES    (4 << 20)
+#define STRING_OPS      1000000
+#define STRING_LEN      32
+#define VARIATE_VALUES  (4 << 20)
+#define DISCRETE_SIZE   1000000
+#define SHUFFLE_SIZE    10000000
+#define IOV_FIELDS      4096
+#define IOV_ROUNDS      200
+#define TOKEN_COUNT     4096
+#define TOKEN_ROUNDS    200
+#define CONTEXT_COUNT   4096
+#define CONTEXT_ROUNDS  100
+
+static double
+now(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void
+bench_seed(prngctx_t *c, int flags)
+{
+  char seed[512];
+  int i;
+
+  for (i = 0; i < (int)sizeof(seed); i++)
+  {
+    seed[i] = (char)(i * 131 + 7);
+  }
+  memset(c, 0, sizeof(prngctx_t));
+  PRNG_init_ex(c, seed, 0, 0, flags);
+}
+
+/* Contention: many threads making small requests at once. */
+
+static pthread_mutex_t startlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t startcond = PTHREAD_COND_INITIALIZER;
+static int started;
+
+static void *
+contention_worker(void *arg)
+{
+  prngctx_t *c = (prngctx_t *)arg;
+  char buf[CONTENTION_LEN];
+  int i;
+
+  pthread_mutex_lock(&startlock);
+  while (!started)
+  {
+    pthread_cond_wait(&startcond, &startlock);
+  }
+  pthread_mutex_unlock(&startlock);
+
+  for (i = 0; i < CONTENTION_OPS; i++)
+  {
+    PRNG_output(c, buf, sizeof(buf));
+  }
+  return NULL;
+}
+
+/* mode 0: one shared context, 1: a locked context per thread,
+ * 2: a PRNG_SINGLE_OWNER context per thread
+ */
+static double
+contention_run(int nthreads, int mode)
+{
+  static prngctx_t ctx[MAX_THREADS];
+  pthread_t tid[MAX_THREADS];
+  double start;
+  int i;
+
+  for (i = 0; i < nthreads; i++)
+  {
+    if (mode || !i)
+    {
+      bench_seed(&ctx[i], mode == 2 ? PRNG_SINGLE_OWNER : 0);
+    }
+  }
+
+  started = 0;
+  for (i = 0; i < nthreads; i++)
+  {
+    pthread_create(&tid[i], NULL, contention_worker, &ctx[mode ? i : 0]);
+  }
+
+  start = now();
+  pthread_mutex_lock(&startlock);
+  started = 1;
+  pthread_cond_broadcast(&startcond);
+  pthread_mutex_unlock(&startlock);
+
+  for (i = 0; i < nthreads; i++)
+  {
+    pthread_join(tid[i], NULL);
+  }
+
+  for (i = 0; i < nthreads; i++)
+  {
+    if (mode || !i)
+    {
+      PRNG_destroy(&ctx[i]);
+    }
+  }
+  return (double)nthreads * CONTENTION_OPS / (now() - start);
+}
+
+static void
+bench_contention(void)
+{
+  static const char *modes[] = { "shared", "per-thread", "single-owner" };
+  double base[3], ops;
+  int n, mode;
+
+  printf("contention: %d-byte PRNG_output calls, Mcalls/s (scaling vs 1 thread)\n",
+         CONTENTION_LEN);
+  printf("%8s %22s %22s %22s\n", "threads", modes[0], modes[1], modes[2]);
+  for (n = 1; n <= MAX_THREADS; n *= 2)
+  {
+    printf("%8d", n);
+    for (mode = 0; mode < 3; mode++)
+    {
+      ops = contention_run(n, mode);
+      if (n == 1)
+      {
+        base[mode] = ops;
+      }
+      printf(" %14.2f (%5.2fx)", ops / 1e6, ops / base[mode]);
+    }
+    printf("\n");
+  }
+}
+
+/* Small draws: egads_randint with and without the per-thread cache. */
+
+static void
+bench_smalldraw(void)
+{
+  static const int sizes[] = { 0, 256, 4096, 65536 };
+  prngctx_t c;
+  unsigned int v;
+  double start;
+  int i, j, err;
+
+  printf("smalldraw: egads_randint, Mcalls/s by per-thread cache size\n");
+  for (j = 0; j < (int)(sizeof(sizes) / sizeof(sizes[0])); j++)
+  {
+    bench_seed(&c, 0);
+    egads_setcache(&c, sizes[j], &err);
+    start = now();
+    for (i = 0; i < SMALLDRAW_OPS; i++)
+    {
+      egads_randint(&c, &v, &err);
+    }
+    printf("%8d bytes %10.2f\n", sizes[j], SMALLDRAW_OPS / (now() - start) / 1e6);
+    PRNG_destroy(&c);
+  }
+}
+
+/* Reseeding: how often keys are scheduled for different request sizes. */
+
+static void
+bench_reseed(void)
+{
+  static const int sizes[] = { 4, 64, 4096, 65536, 1 << 20 };
+  static char buf[1 << 20];
+  prngctx_t c;
+  prngstats_t st;
+  double start, secs;
+  int i, j, n;
+
+  printf("reseed: %d MiB in requests of each size\n", RESEED_BYTES >> 20);
+  printf("%10s %10s %12s %12s %12s\n", "size", "MB/s", "blocks", "selfreseeds",
+         "rekeys");
+  for (j = 0; j < (int)(sizeof(sizes) / sizeof(sizes[0])); j++)
+  {
+    bench_seed(&c, 0);
+    n = RESEED_BYTES / sizes[j];
+    start = now();
+    for (i = 0; i < n; i++)
+    {
+      PRNG_output(&c, buf, sizes[j]);
+    }
+    secs = now() - start;
+    PRNG_stats(&c, &st);
+    printf("%10d %10.1f %12llu %12llu %12llu\n", sizes[j],
+           RESEED_BYTES / secs / 1e6, (unsigned long long)st.blocks,
+           (unsigned long long)st.selfreseeds, (unsigned long long)st.rekeys);
+    PRNG_destroy(&c);
+  }
+}
+
+/* Parallel fill: one large egads_randbuf_parallel call per thread count. */
+
+static void
+bench_parallel(void)
+{
+  prngctx_t c;
+  char *buf;
+  double start, rate, base = 0;
+  int n, err;
+
+  if ((buf = malloc(PARALLEL_BYTES)) == NULL)
+  {
+    return;
+  }
+  printf("parallel: %d MiB egads_randbuf_parallel, MB/s (scaling vs 1 thread)\n",
+         PARALLEL_BYTES >> 20);
+  bench_seed(&c, 0);
+  /* Fault the pages in before timing anything */
+  egads_randbuf_parallel(&c, buf, PARALLEL_BYTES, 1, &err);
+  for (n = 1; n <= MAX_THREADS; n *= 2)
+  {
+    start = now();
+    egads_randbuf_parallel(&c, buf, PARALLEL_BYTES, n, &err);
+    rate = PARALLEL_BYTES / (now() - start) / 1e6;
+    if (n == 1)
+    {
+      base = rate;
+    }
+    printf("%8d %10.1f (%5.2fx)\n", n, rate, rate / base);
+  }
+  PRNG_destroy(&c);
+  free(buf);
+}
+
+/* Ciphers: keystream throughput for each cipher and backend. */
+
+static void
+bench_cipher(void)
+{
+  static const struct
+  {
+    const char *name;
+    int flags, aes, chacha;
+  } ciphers[] = {
+    { "aes-ni", 0, AES_BACKEND_AESNI, CHACHA_BACKEND_AUTO },
+    { "aes-table", 0, AES_BACKEND_TABLE, CHACHA_BACKEND_AUTO },
+    { "chacha20-avx2", PRNG_CHACHA20, AES_BACKEND_AUTO, CHACHA_BACKEND_AVX2 },
+    { "chacha20-sse2", PRNG_CHACHA20, AES_BACKEND_AUTO, CHACHA_BACKEND_SSE2 },
+    { "chacha20-c", PRNG_CHACHA20, AES_BACKEND_AUTO, CHACHA_BACKEND_SCALAR },
+  };
+  static const int sizes[] = { 16, 4096, 1 << 20 };
+  static char buf[1 << 20];
+  prngctx_t c;
+  double start;
+  int i, j, k, n;
+
+  printf("cipher: MB/s by PRNG_output request size\n");
+  printf("%14s", "");
+  for (j = 0; j < (int)(sizeof(sizes) / sizeof(sizes[0])); j++)
+  {
+    printf(" %10d", sizes[j]);
+  }
+  printf("\n");
+  for (i = 0; i < (int)(sizeof(ciphers) / sizeof(ciphers[0])); i++)
+  {
+    /* Skip backends this CPU lacks rather than timing the fallback */
+    if (aes_set_backend(ciphers[i].aes) != ciphers[i].aes
+        && ciphers[i].aes != AES_BACKEND_AUTO)
+    {
+      continue;
+    }
+    if (chacha_set_backend(ciphers[i].chacha) != ciphers[i].chacha
+        && ciphers[i].chacha != CHACHA_BACKEND_AUTO)
+    {
+      continue;
+    }
+    printf("%14s", ciphers[i].name);
+    for (j = 0; j < (int)(sizeof(sizes) / sizeof(sizes[0])); j++)
+    {
+      bench_seed(&c, ciphers[i].flags);
+      n = CIPHER_BYTES / sizes[j];
+      if (sizes[j] < 4096)
+      {
+        n /= 16;
+      }
+      start = now();
+      for (k = 0; k < n; k++)
+      {
+        PRNG_output(&c, buf, sizes[j]);
+      }
+      printf(" %10.1f", (double)n * sizes[j] / (now() - start) / 1e6);
+      PRNG_destroy(&c);
+    }
+    printf("\n");
+  }
+  aes_set_backend(AES_BACKEND_AUTO);
+  chacha_set_backend(CHACHA_BACKEND_AUTO);
+}
+
+/* Bounded integers: egads_randrange per value vs egads_randrange_array. */
+
+static void
+bench_randrange(void)
+{
+  static const int batches[] = { 1, 16, 256, 4096 };
+  static int out[4096];
+  prngctx_t c;
+  double start;
+  int i, j, err;
+
+  printf("randrange: Mvalues/s in [0, 999], by values per call\n");
+  bench_seed(&c, 0);
+  start = now();
+  for (i = 0; i < RANGE_VALUES; i++)
+  {
+    egads_randrange(&c, &out[0], 0, 999, &err);
+  }
+  printf("%8s %10.2f\n", "single", RANGE_VALUES / (now() - start) / 1e6);
+  for (j = 0; j < (int)(sizeof(batches) / sizeof(batches[0])); j++)
+  {
+    start = now();
+    for (i = 0; i < RANGE_VALUES; i += batches[j])
+    {
+      egads_randrange_array(&c, out, batches[j], 0, 999, &err);
+    }
+    printf("%8d %10.2f\n", batches[j], RANGE_VALUES / (now() - start) / 1e6);
+  }
+  PRNG_destroy(&c);
+}
+
+/* Strings: egads_randstring and egads_randfname of STRING_LEN characters. */
+
+static void
+bench_strings(void)
+{
+  char out[STRING_LEN + 1];
+  prngctx_t c;
+  double start;
+  int i, err;
+
+  printf("strings: %d-character strings, Mcalls/s\n", STRING_LEN);
+  bench_seed(&c, 0);
+  start = now();
+  for (i = 0; i < STRING_OPS; i++)
+  {
+    egads_randstring(&c, out, STRING_LEN, &err);
+  }
+  printf("%12s %10.2f\n", "randstring", STRING_OPS / (now() - start) / 1e6);
+  start = now();
+  for (i = 0; i < STRING_OPS; i++)
+  {
+    egads_randfname(&c, out, STRING_LEN, &err);
+  }
+  printf("%12s %10.2f\n", "randfname", STRING_OPS / (now() - start) / 1e6);
+  PRNG_destroy(&c);
+}
+
+/* Reals: egads_randreal per value vs egads_randreal_array. */
+
+static void
+bench_reals(void)
+{
+  static const int batches[] = { 16, 256, 4096 };
+  static double out[4096];
+  prngctx_t c;
+  double start;
+  int i, j, err;
+
+  printf("reals: Mvalues/s in [0,1), by values per call\n");
+  bench_seed(&c, 0);
+  start = now();
+  for (i = 0; i < VARIATE_VALUES; i++)
+  {
+    egads_randreal(&c, &out[0], &err);
+  }
+  printf("%8s %10.2f\n", "single", VARIATE_VALUES / (now() - start) / 1e6);
+  for (j = 0; j < (int)(sizeof(batches) / sizeof(batches[0])); j++)
+  {
+    start = now();
+    for (i = 0; i < VARIATE_VALUES; i += batches[j])
+    {
+      egads_randreal_array(&c, out, batches[j], &err);
+    }
+    printf("%8d %10.2f\n", batches[j], VARIATE_VALUES / (now() - start) / 1e6);
+  }
+  PRNG_destroy(&c);
+}
+
+/* Variates: normal and exponential values one at a time and in batches. */
+
+static void
+bench_variates(void)
+{
+  static const int batches[] = { 16, 256, 4096 };
+  static double out[4096];
+  prngctx_t c;
+  double start;
+  int i, j, err;
+
+  printf("variates: Mvalues/s, single calls and by values per call\n");
+  printf("%8s %12s %12s\n", "", "normal", "exponential");
+  bench_seed(&c, 0);
+  printf("%8s", "single");
+  start = now();
+  for (i = 0; i < VARIATE_VALUES; i++)
+  {
+    egads_gauss(&c, &out[0], 0.0, 1.0, &err);
+  }
+  printf(" %12.2f", VARIATE_VALUES / (now() - start) / 1e6);
+  start = now();
+  for (i = 0; i < VARIATE_VALUES; i++)
+  {
+    egads_expovariate(&c, &out[0], 1.0, &err);
+  }
+  printf(" %12.2f\n", VARIATE_VALUES / (now() - start) / 1e6);
+  for (j = 0; j < (int)(sizeof(batches) / sizeof(batches[0])); j++)
+  {
+    printf("%8d", batches[j]);
+    start = now();
+    for (i = 0; i < VARIATE_VALUES; i += batches[j])
+    {
+      egads_gauss_array(&c, out, batches[j], 0.0, 1.0, &err);
+    }
+    printf(" %12.2f", VARIATE_VALUES / (now() - start) / 1e6);
+    start = now();
+    for (i = 0; i < VARIATE_VALUES; i += batches[j])
+    {
+      egads_expovariate_array(&c, out, batches[j], 1.0, &err);
+    }
+    printf(" %12.2f\n", VARIATE_VALUES / (now() - start) / 1e6);
+  }
+  PRNG_destroy(&c);
+}
+
+/* Discrete: building a large alias table, then drawing from it. */
+
+static void
+bench_discrete(void)
+{
+  static const int batches[] = { 16, 256, 4096 };
+  static int out[4096];
+  egads_discrete_t d;
+  prngctx_t c;
+  double *weights, start;
+  int i, j, err;
+
+  if ((weights = malloc(DISCRETE_SIZE * sizeof(double))) == NULL)
+  {
+    return;
+  }
+  /* Zipf weights, so that columns need a wide range of top ups */
+  for (i = 0; i < DISCRETE_SIZE; i++)
+  {
+    weights[i] = 1.0 / (i + 1);
+  }
+  start = now();
+  egads_discrete_init(&d, weights, DISCRETE_SIZE, &err);
+  printf("discrete: %d outcomes, built in %.1f ms, table %lu bytes\n",
+         DISCRETE_SIZE, (now() - start) * 1e3,
+         (unsigned long)(DISCRETE_SIZE * sizeof(egads_alias_t)));
+  free(weights);
+  if (err)
+  {
+    return;
+  }
+
+  printf("Mvalues/s by values per call\n");
+  bench_seed(&c, 0);
+  start = now();
+  for (i = 0; i < VARIATE_VALUES; i++)
+  {
+    egads_discrete(&c, &d, &out[0], &err);
+  }
+  printf("%8s %10.2f\n", "single", VARIATE_VALUES / (now() - start) / 1e6);
+  for (j = 0; j < (int)(sizeof(batches) / sizeof(batches[0])); j++)
+  {
+    start = now();
+    for (i = 0; i < VARIATE_VALUES; i += batches[j])
+    {
+      egads_discrete_array(&c, &d, out, batches[j], &err);
+    }
+    printf("%8d %10.2f\n", batches[j], VARIATE_VALUES / (now() - start) / 1e6);
+  }
+  PRNG_destroy(&c);
+  egads_discrete_destroy(&d);
+}
+
+/* Shuffle and sample: egads_shuffle and egads_sample against the obvious
+ * egads_randrange loops. */
+
+static void
+bench_shuffle(void)
+{
+  static const int ks[] = { 1000, 100000, 1000000 };
+  prngctx_t c;
+  int *a, *out, i, j, t, err;
+  double start;
+
+  if ((a = malloc(SHUFFLE_SIZE * sizeof(int))) == NULL)
+  {
+    return;
+  }
+  if ((out = malloc(ks[2] * sizeof(int))) == NULL)
+  {
+    free(a);
+    return;
+  }
+  for (i = 0; i < SHUFFLE_SIZE; i++)
+  {
+    a[i] = i;
+  }
+  bench_seed(&c, 0);
+
+  printf("shuffle: %d ints, seconds\n", SHUFFLE_SIZE);
+  start = now();
+  for (i = SHUFFLE_SIZE - 1; i > 0; i--)
+  {
+    egads_randrange(&c, &j, 0, i, &err);
+    t = a[i];
+    a[i] = a[j];
+    a[j] = t;
+  }
+  printf("%24s %10.3f\n", "egads_randrange loop", now() - start);
+  start = now();
+  egads_shuffle(&c, a, SHUFFLE_SIZE, sizeof(int), &err);
+  printf("%24s %10.3f\n", "egads_shuffle", now() - start);
+
+  printf("sample: k of %d, ms\n", SHUFFLE_SIZE);
+  printf("%10s %24s %14s\n", "k", "partial randrange loop", "egads_sample");
+  for (j = 0; j < (int)(sizeof(ks) / sizeof(ks[0])); j++)
+  {
+    printf("%10d", ks[j]);
+    /* The loop shuffles just the first k places of the array */
+    start = now();
+    for (i = 0; i < ks[j]; i++)
+    {
+      egads_randrange(&c, &t, i, SHUFFLE_SIZE - 1, &err);
+      out[i] = a[t];
+      a[t] = a[i];
+      a[i] = out[i];
+    }
+    printf(" %24.2f", (now() - start) * 1e3);
+    start = now();
+    egads_sample(&c, SHUFFLE_SIZE, ks[j], out, &err);
+    printf(" %14.2f\n", (now() - start) * 1e3);
+  }
+  PRNG_destroy(&c);
+  free(out);
+  free(a);
+}
+
+/* Scatter fills: many small fields, one call each vs one egads_randbuf_iov. */
+
+static void
+bench_iov(void)
+{
+  static const int sizes[] = { 8, 16, 32, 128 };
+  static char buf[IOV_FIELDS * 128];
+  static struct iovec iov[IOV_FIELDS];
+  prngctx_t c;
+  double start;
+  int i, j, r;
+
+  printf("iov: %d fields per batch, Mfields/s\n", IOV_FIELDS);
+  printf("%8s %14s %18s\n", "size", "egads_randbuf", "egads_randbuf_iov");
+  bench_seed(&c, 0);
+  for (j = 0; j < (int)(sizeof(sizes) / sizeof(sizes[0])); j++)
+  {
+    /* Fields spread apart, as they would be in a batch of records */
+    for (i = 0; i < IOV_FIELDS; i++)
+    {
+      iov[i].iov_base = &buf[i * 128];
+      iov[i].iov_len = sizes[j];
+    }
+    start = now();
+    for (r = 0; r < IOV_ROUNDS; r++)
+    {
+      for (i = 0; i < IOV_FIELDS; i++)
+      {
+        egads_randbuf(&c, (char *)iov[i].iov_base, iov[i].iov_len);
+      }
+    }
+    printf("%8d %14.2f", sizes[j],
+           (double)IOV_FIELDS * IOV_ROUNDS / (now() - start) / 1e6);
+    start = now();
+    for (r = 0; r < IOV_ROUNDS; r++)
+    {
+      egads_randbuf_iov(&c, iov, IOV_FIELDS);
+    }
+    printf(" %18.2f\n", (double)IOV_FIELDS * IOV_ROUNDS / (now() - start) / 1e6);
+  }
+  PRNG_destroy(&c);
+}
+
+/* Tokens: egads_randbuf and sprintf per token vs the bulk formatters. */
+
+static void
+bench_tokens(void)
+{
+  static char out[TOKEN_COUNT * EGADS_UUID_LEN];
+  unsigned char u[16];
+  prngctx_t c;
+  double start;
+  int i, j, r, err;
+
+  printf("tokens: %d per batch, Mtokens/s\n", TOKEN_COUNT);
+  bench_seed(&c, 0);
+
+  start = now();
+  for (r = 0; r < TOKEN_ROUNDS; r++)
+  {
+    for (i = 0; i < TOKEN_COUNT; i++)
+    {
+      egads_randbuf(&c, (char *)u, sizeof(u));
+      u[6] = (u[6] & 0x0f) | 0x40;
+      u[8] = (u[8] & 0x3f) | 0x80;
+      sprintf(&out[i * EGADS_UUID_LEN],
+              "%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+              u[0], u[1], u[2], u[3], u[4], u[5], u[6], u[7], u[8], u[9],
+              u[10], u[11], u[12], u[13], u[14], u[15]);
+    }
+  }
+  printf("%28s %10.2f\n", "uuid, randbuf + sprintf",
+         (double)TOKEN_COUNT * TOKEN_ROUNDS / (now() - start) / 1e6);
+  start = now();
+  for (r = 0; r < TOKEN_ROUNDS; r++)
+  {
+    egads_uuid4_array(&c, out, TOKEN_COUNT, &err);
+  }
+  printf("%28s %10.2f\n", "egads_uuid4_array",
+         (double)TOKEN_COUNT * TOKEN_ROUNDS / (now() - start) / 1e6);
+
+  start = now();
+  for (r = 0; r < TOKEN_ROUNDS; r++)
+  {
+    for (i = 0; i < TOKEN_COUNT; i++)
+    {
+      egads_randbuf(&c, (char *)u, sizeof(u));
+      for (j = 0; j < (int)sizeof(u); j++)
+      {
+        sprintf(&out[i * 33 + 2 * j], "%02x", u[j]);
+      }
+    }
+  }
+  printf("%28s %10.2f\n", "16-byte hex, randbuf + sprintf",
+         (double)TOKEN_COUNT * TOKEN_ROUNDS / (now() - start) / 1e6);
+  start = now();
+  for (r = 0; r < TOKEN_ROUNDS; r++)
+  {
+    egads_token_array(&c, out, TOKEN_COUNT, 16, EGADS_TOKEN_HEX, &err);
+  }
+  printf("%28s %10.2f\n", "16-byte hex, token_array",
+         (double)TOKEN_COUNT * TOKEN_ROUNDS / (now() - start) / 1e6);
+  start = now();
+  for (r = 0; r < TOKEN_ROUNDS; r++)
+  {
+    egads_token_array(&c, out, TOKEN_COUNT, 16, EGADS_TOKEN_BASE64URL, &err);
+  }
+  printf("%28s %10.2f\n", "16-byte base64url, token_array",
+         (double)TOKEN_COUNT * TOKEN_ROUNDS / (now() - start) / 1e6);
+  PRNG_destroy(&c);
+}
+
+/* Contexts: thousands of contexts, allocated one by one vs from a pool,
+ * drawn from in turn so that every request finds its context cold.
+ */
+
+static void
+bench_contexts(void)
+{
+  static prngctx_t *ctx[CONTEXT_COUNT];
+  prngpool_t *pool = NULL;
+  char buf[16];
+  double start, setup;
+  int i, r, mode;
+
+  printf("contexts: %d contexts of %d bytes\n", CONTEXT_COUNT,
+         (int)sizeof(prngctx_t));
+  printf("%8s %14s %14s\n", "alloc", "setup us/ctx", "Mdraws/s");
+  for (mode = 0; mode < 2; mode++)
+  {
+    start = now();
+    if (mode)
+    {
+      pool = PRNG_pool_new(CONTEXT_COUNT);
+    }
+    for (i = 0; i < CONTEXT_COUNT; i++)
+    {
+      ctx[i] = mode ? PRNG_pool_get(pool)
+                    : (prngctx_t *)malloc(sizeof(prngctx_t));
+      bench_seed(ctx[i], PRNG_SINGLE_OWNER);
+    }
+    setup = now() - start;
+
+    start = now();
+    for (r = 0; r < CONTEXT_ROUNDS; r++)
+    {
+      for (i = 0; i < CONTEXT_COUNT; i++)
+      {
+        egads_randbuf(ctx[i], buf, sizeof(buf));
+      }
+    }
+    printf("%8s %14.2f %14.2f\n", mode ? "pool" : "malloc",
+           setup / CONTEXT_COUNT * 1e6,
+           (double)CONTEXT_COUNT * CONTEXT_ROUNDS / (now() - start) / 1e6);
+
+    for (i = 0; i < CONTEXT_COUNT; i++)
+    {
+      PRNG_destroy(ctx[i]);
+      if (mode)
+      {
+        PRNG_pool_put(pool, ctx[i]);
+      }
+      else
+      {
+        free(ctx[i]);
+      }
+    }
+    if (mode)
+    {
+      PRNG_pool_free(pool);
+    }
+  }
+}
+
+static struct
+{
+  const char *name;
+  void (*run)(void);
+} tests[] = {
+  { "contention", bench_contention },
+  { "smalldraw", bench_smalldraw },
+  { "reseed", bench_reseed },
+  { "parallel", bench_parallel },
+  { "cipher", bench_cipher },
+  { "randrange", bench_randrange },
+  { "strings", bench_strings },
+  { "reals", bench_reals },
+  { "variates", bench_variates },
+  { "discrete", bench_discrete },
+  { "shuffle", bench_shuffle },
+  { "iov", bench_iov },
+  { "tokens", bench_tokens },
+  { "contexts", bench_contexts },
+};
+
+#define NUM_TESTS ((int)(sizeof(tests) / sizeof(tests[0])))
+
+int
+main(int argc, char **argv)
+{
+  int i, j;
+
+  if (argc < 2)
+  {
+    for (i = 0; i < NUM_TESTS; i++)
+    {
+      tests[i].run();
+    }
+    return 0;
+  }
+
+  for (j = 1; j < argc; j++)
+  {
+    for (i = 0; i < NUM_TESTS && strcmp(argv[j], tests[i].name); i++)
+      ;
+    if (i == NUM_TESTS)
+    {
+      fprintf(stderr, "usage: %s [test ...]\ntests:", argv[0]);
+      for (i = 0; i < NUM_TESTS; i++)
+      {
+        fprintf(stderr, " %s", tests[i].name);
+      }
+      fprintf(stderr, "\n");
+      return 1;
+    }
+    tests[i].run();
+  }
+  return 0;
+}
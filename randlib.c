@@ -1,10 +1,19 @@
+#include <float.h>
+
 #include "platform.h"
+#include "ziggurat.h"
 
 #define PI 3.1415926535
 
-static char *fnametable = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ01234567890.";
+static const char fnametable[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ01234567890.";
+
+/* ASCII 33 through 126 */
+static const char printable[] = "!\"#$%&'()*+,-./0123456789:;<=>?@"
+                                "ABCDEFGHIJKLMNOPQRSTUVWXYZ[\\]^_`"
+                                "abcdefghijklmnopqrstuvwxyz{|}~";
 
 extern char *gather_entropy(int howmuch, eg_t *ctx);
+extern int fill_entropy(char *buf, int howmuch, eg_t *ctx);
 
 void
 free_seedbuf(void *buf)
@@ -12,78 +21,181 @@ free_seedbuf(void *buf)
   EGADS_FREE(buf);
 }
 
-void
-egads_init(prngctx_t * ctx, char *sockname, char *rfile, int *error)
+/* The entropy source paths are the only part of a context kept outside of
+   it, so that the context itself stays small enough to pack into pools. */
+static void
+free_paths(prngctx_t * ctx)
 {
-  char *myseed = NULL;
-  
-  if (rfile)
+  if (ctx->eg.sockname)
   {
-    strncpy(ctx->eg.randfile, rfile, sizeof(ctx->eg.randfile) - 1);
+    EGADS_FREE(ctx->eg.sockname);
   }
-  else
+  if (ctx->eg.randfile)
   {
-    strncpy(ctx->eg.randfile, "/dev/random", sizeof(ctx->eg.randfile) - 1);
+    EGADS_FREE(ctx->eg.randfile);
   }
-  ctx->eg.randfile[sizeof(ctx->eg.randfile)-1] = 0;
+  ctx->eg.sockname = NULL;
+  ctx->eg.randfile = NULL;
+}
+
+void
+egads_init_ex(prngctx_t * ctx, char *sockname, char *rfile, int flags,
+              int *error)
+{
+  char myseed[PRNG_SEED_LEN];
+  
+  /* Until PRNG_init_ex runs there is nothing for egads_destroy to undo */
+  ctx->flags = 0;
+  ctx->eg.randfile = EGADS_STRDUP((rfile ? rfile : "/dev/random"));
 
   if (sockname)
   {
-    strncpy(ctx->eg.sockname, sockname, sizeof(ctx->eg.sockname) - 1);
+    ctx->eg.sockname = EGADS_STRDUP(sockname);
   }
   else 
   {
 #ifndef WIN32
-    strncpy(ctx->eg.sockname, EGADSDATA "/" SOCK_FILE_NAME, sizeof(ctx->eg.sockname) - 1);
+    ctx->eg.sockname = EGADS_STRDUP(EGADSDATA "/" SOCK_FILE_NAME);
 #else
-    strcpy(ctx->eg.sockname, EGADS_MAILSLOT_NAME);
+    ctx->eg.sockname = EGADS_STRDUP(EGADS_MAILSLOT_NAME);
 #endif
   }
 
-  ctx->eg.sockname[sizeof(ctx->eg.sockname)-1] = 0;
+  if (!ctx->eg.randfile || !ctx->eg.sockname)
+  {
+    free_paths(ctx);
+    *error = RERR_NOMEM;
+    return;
+  }
 
   ctx->eg.eg = gather_entropy;
   ctx->eg.egfree = free_seedbuf;
-  ctx->eg.gaussstate = 0;
+  ctx->eg.egfill = fill_entropy;
 
-  myseed = gather_entropy(KEY_LEN, &(ctx->eg));
-  *error = (myseed ? PRNG_init(ctx, myseed, 300, 0) : RERR_CONNFAILED);
-	      
-  return;
+  if (!fill_entropy(myseed, PRNG_SEED_LEN, &(ctx->eg)))
+  {
+    free_paths(ctx);
+    *error = RERR_CONNFAILED;
+    return;
+  }
+  *error = PRNG_init_ex(ctx, myseed, 300, 0, flags);
+  memset(myseed, 0, sizeof(myseed));
+}
+
+void
+egads_init(prngctx_t * ctx, char *sockname, char *rfile, int *error)
+{
+  egads_init_ex(ctx, sockname, rfile, 0, error);
 }
 
 void
 egads_destroy(prngctx_t * ctx)
 {
+  if (ctx->flags & PRNG_INITIALIZED)
+  {
+    PRNG_destroy(ctx);
+  }
+  free_paths(ctx);
   memset(ctx, 0, sizeof(prngctx_t));
 }
 
+/* A pool of n contexts in one locked region. Contexts taken from it with
+   egads_pool_get are initialized with egads_init_ex as usual. */
+prngpool_t *
+egads_pool_new(int n, int *error)
+{
+  prngpool_t *pool = NULL;
+
+  *error = 0;
+  if (n <= 0)
+  {
+    *error = RERR_BADARGS;
+  }
+  else if (!(pool = PRNG_pool_new(n)))
+  {
+    *error = RERR_NOMEM;
+  }
+  return pool;
+}
+
+prngctx_t *
+egads_pool_get(prngpool_t *pool, int *error)
+{
+  prngctx_t *ctx;
+
+  *error = 0;
+  if (pool == NULL)
+  {
+    *error = RERR_NOHANDLE;
+    return NULL;
+  }
+  if (!(ctx = PRNG_pool_get(pool)))
+  {
+    *error = RERR_NOMEM;
+  }
+  return ctx;
+}
+
+/* Destroy ctx and return it to pool */
 void
-egads_entropy(prngctx_t *ctx, char *buf, int size, int *error)
+egads_pool_put(prngpool_t *pool, prngctx_t *ctx)
 {
-  char *entropy;
+  if (pool == NULL || ctx == NULL)
+  {
+    return;
+  }
+  egads_destroy(ctx);
+  PRNG_pool_put(pool, ctx);
+}
+
+void
+egads_pool_free(prngpool_t *pool)
+{
+  if (pool)
+  {
+    PRNG_pool_free(pool);
+  }
+}
 
+/* Serve egads_randint, egads_randlong and egads_randreal from a per-thread
+   buffer of size bytes of keystream. size 0 turns the buffers off. */
+void
+egads_setcache(prngctx_t *ctx, int size, int *error)
+{
   *error = 0;
   if (ctx == NULL)
   {
     *error = RERR_NOHANDLE;
     return;
   }
+  if (size < 0 || PRNG_setcache(ctx, size))
+  {
+    *error = RERR_BADARGS;
+  }
+}
 
-  entropy = gather_entropy(size, &(ctx->eg));
-  if (entropy == NULL)
+/* Fill buf with size random bytes, spreading the work over nthreads
+   threads. The result is the same as a single PRNG_output call. */
+void
+egads_randbuf_parallel(prngctx_t *ctx, char *buf, uint64 size, int nthreads,
+                       int *error)
+{
+  *error = 0;
+  if (ctx == NULL)
   {
-    *error = RERR_CONNFAILED;
+    *error = RERR_NOHANDLE;
+    return;
   }
-  else
+  if (buf == NULL || nthreads < 1)
   {
-    memcpy(buf, entropy, size);
-    EGADS_FREE(entropy);
+    *error = RERR_BADARGS;
+    return;
   }
+  PRNG_output_parallel(ctx, buf, size, nthreads);
 }
 
 void
-egads_randlong(prngctx_t *ctx, long *out, int *error)
+egads_skip(prngctx_t *ctx, uint64 blocks, int *error)
 {
   *error = 0;
   if (ctx == NULL)
@@ -91,13 +203,28 @@ egads_randlong(prngctx_t *ctx, long *out, int *error)
     *error = RERR_NOHANDLE;
     return;
   }
+  PRNG_skip(ctx, blocks);
+}
 
-  PRNG_output(ctx, (char *)out, sizeof(long));
+/* Derive n contexts from ctx, each with its own slice of the counter space.
+   Each child must be released with egads_destroy. */
+void
+egads_split(prngctx_t *ctx, int n, prngctx_t *children, int flags, int *error)
+{
+  *error = 0;
+  if (ctx == NULL)
+  {
+    *error = RERR_NOHANDLE;
+    return;
+  }
+  if (PRNG_split(ctx, n, children, flags))
+  {
+    *error = RERR_BADARGS;
+  }
 }
 
-/* Get a random integer between 0 and UINT_MAX */
 void
-egads_randint(prngctx_t * ctx, unsigned int *out, int *error)
+egads_entropy(prngctx_t *ctx, char *buf, int size, int *error)
 {
   *error = 0;
   if (ctx == NULL)
@@ -106,61 +233,155 @@ egads_randint(prngctx_t * ctx, unsigned int *out, int *error)
     return;
   }
 
-  PRNG_output(ctx, (char *)out, sizeof(unsigned int));
+  if (!fill_entropy(buf, size, &(ctx->eg)))
+  {
+    *error = RERR_CONNFAILED;
+  }
 }
 
-/* Get a random number (double) between 0 and 1 */
 void
-egads_randreal(prngctx_t * ctx, double *out, int *error)
+egads_randlong(prngctx_t *ctx, long *out, int *error)
 {
-  unsigned int rado;
-
+  *error = 0;
   if (ctx == NULL)
   {
     *error = RERR_NOHANDLE;
     return;
   }
 
-  egads_randint(ctx, &rado, error); 
-  *out = rado / (double)0xffffffff;
+  PRNG_output_cached(ctx, (char *)out, sizeof(long));
 }
 
-void egads_gauss(prngctx_t *ctx, double *out, double mu, double sigma, int *error)
+/* Get a random integer between 0 and UINT_MAX */
+void
+egads_randint(prngctx_t * ctx, unsigned int *out, int *error)
 {
-  double g2rad, myr, x2pi, z;
-  
   *error = 0;
-  z = ctx->eg.gaussstate;
-  ctx->eg.gaussstate = 0;
-  if (!z)
+  if (ctx == NULL)
   {
-    egads_randreal(ctx, &myr, error);
-    x2pi = myr * (PI * 2);
-    egads_randreal(ctx, &myr, error);
-    g2rad = sqrt(-2.0 * log(1.0 - myr)) ;
-    z = cos(x2pi) * g2rad;
-    ctx->eg.gaussstate = sin(x2pi) * g2rad;
+    *error = RERR_NOHANDLE;
+    return;
   }
-  *out = mu + z*sigma;
+
+  PRNG_output_cached(ctx, (char *)out, sizeof(unsigned int));
 }
 
-void egads_normalvariate(prngctx_t *ctx, double *out, double mu, double sigma, int *error)
+/* Doubles in [0,1) take the top 53 bits of a 64-bit word of keystream, so
+   every multiple of 2^-53 in the interval is equally likely. The words are
+   turned into doubles through the exponent field rather than an integer
+   conversion: the 53 bits are split in two, each half is placed under a
+   fixed exponent and the offsets are subtracted again, all exactly. That
+   takes only masks and adds, which the compiler can vectorize, and
+   measures as fast as SSE2 code written by hand. Keystream is drawn
+   straight into out, REAL_CHUNK values at a time. */
+#define REAL_CHUNK  1024
+#define TWO_52      4503599627370496.0
+#define TWO_84      (TWO_52 * 4294967296.0)
+
+static void
+real_fill(prngctx_t *ctx, double *out, int n)
 {
-  double myr1, myr2, t1, t2;
-  double myconst = 1.71552776992141;
-  
-  for (;;)
+  uint64 w, hi, lo;
+  double dhi, dlo;
+  int i, j, want;
+
+  for (i = 0; i < n; i += want)
   {
-    egads_randreal(ctx, &myr1, error);
-    egads_randreal(ctx, &myr2, error);
-    t1 = myconst * (myr1 - 0.5) / myr2;
-    t2 = t1 * t1 / 4.0;
-    if (t2 <= -log(myr2))
+    want = (n - i < REAL_CHUNK ? n - i : REAL_CHUNK);
+    PRNG_output_cached(ctx, (char *)&out[i], want * sizeof(double));
+    for (j = i; j < i + want; j++)
     {
-      break;
+      memcpy(&w, &out[j], sizeof(w));
+      w >>= 11;
+      hi = (w >> 32) | 0x4530000000000000ULL;           /* 2^84 + hi * 2^32 */
+      lo = (w & 0xffffffffULL) | 0x4330000000000000ULL; /* 2^52 + lo */
+      memcpy(&dhi, &hi, sizeof(dhi));
+      memcpy(&dlo, &lo, sizeof(dlo));
+      out[j] = ((dhi - TWO_84) + (dlo - TWO_52)) * (0.5 / TWO_52);
     }
   }
-  *out = mu + t1 * sigma;
+}
+
+/* Shared argument checks of the array functions */
+static int
+array_args(prngctx_t *ctx, void *out, int n, int *error)
+{
+  *error = 0;
+  if (ctx == NULL)
+  {
+    *error = RERR_NOHANDLE;
+  }
+  else if (n < 0 || (n > 0 && out == NULL))
+  {
+    *error = RERR_BADARGS;
+  }
+  return *error;
+}
+
+/* Fill out with n doubles in [0,1) */
+void
+egads_randreal_array(prngctx_t *ctx, double *out, int n, int *error)
+{
+  if (array_args(ctx, out, n, error))
+  {
+    return;
+  }
+  real_fill(ctx, out, n);
+}
+
+/* Get a random number (double) in [0,1) */
+void
+egads_randreal(prngctx_t * ctx, double *out, int *error)
+{
+  egads_randreal_array(ctx, out, 1, error);
+}
+
+/* Doubles with min <= out < max */
+void
+egads_randuniform_array(prngctx_t *ctx, double *out, int n, double min,
+                        double max, int *error)
+{
+  int i;
+
+  if (array_args(ctx, out, n, error))
+  {
+    return;
+  }
+  real_fill(ctx, out, n);
+  for (i = 0; i < n; i++)
+  {
+    out[i] = min + (max - min) * out[i];
+  }
+}
+
+/* Normal and exponential values come from the Ziggurat samplers in
+   ziggurat.c, which draw keystream in bulk. The single value functions are
+   the n = 1 case of the array ones. */
+void
+egads_gauss_array(prngctx_t *ctx, double *out, int n, double mu,
+                  double sigma, int *error)
+{
+  int i;
+
+  if (array_args(ctx, out, n, error))
+  {
+    return;
+  }
+  zig_normal(ctx, out, n);
+  for (i = 0; i < n; i++)
+  {
+    out[i] = mu + out[i] * sigma;
+  }
+}
+
+void egads_gauss(prngctx_t *ctx, double *out, double mu, double sigma, int *error)
+{
+  egads_gauss_array(ctx, out, 1, mu, sigma, error);
+}
+
+void egads_normalvariate(prngctx_t *ctx, double *out, double mu, double sigma, int *error)
+{
+  egads_gauss_array(ctx, out, 1, mu, sigma, error);
 }
 
 void egads_lognormalvariate(prngctx_t *ctx, double *out, double mu, double sigma, int *error)
@@ -169,36 +390,74 @@ void egads_lognormalvariate(prngctx_t *ctx, double *out, double mu, double sigma
   *out = exp(*out);
 }
 
-void egads_paretovariate(prngctx_t *ctx, double *out, double alpha, int *error)
+/* The Pareto and Weibull transforms work on 1 - u, which unlike u is never
+   0, so that neither can come out infinite */
+void
+egads_paretovariate_array(prngctx_t *ctx, double *out, int n, double alpha,
+                          int *error)
 {
-  double myr;
+  int i;
 
-  egads_randreal(ctx, &myr, error);
-  *out = 1.0 / pow(myr, 1.0 / alpha);
+  if (array_args(ctx, out, n, error))
+  {
+    return;
+  }
+  real_fill(ctx, out, n);
+  for (i = 0; i < n; i++)
+  {
+    out[i] = 1.0 / pow(1.0 - out[i], 1.0 / alpha);
+  }
 }
 
-void egads_weibullvariate(prngctx_t *ctx, double *out, double alpha, double beta, int *error)
+void egads_paretovariate(prngctx_t *ctx, double *out, double alpha, int *error)
 {
-  double myr;
-  
-  egads_randreal(ctx, &myr, error);
-  *out = alpha * pow(-log(myr), 1.0 / beta);
+  egads_paretovariate_array(ctx, out, 1, alpha, error);
 }
 
+void
+egads_weibullvariate_array(prngctx_t *ctx, double *out, int n, double alpha,
+                           double beta, int *error)
+{
+  int i;
 
+  if (array_args(ctx, out, n, error))
+  {
+    return;
+  }
+  real_fill(ctx, out, n);
+  for (i = 0; i < n; i++)
+  {
+    out[i] = alpha * pow(-log(1.0 - out[i]), 1.0 / beta);
+  }
+}
 
-/* Random double returned with exponential distribution. lambda 1.0/mean */
+void egads_weibullvariate(prngctx_t *ctx, double *out, double alpha, double beta, int *error)
+{
+  egads_weibullvariate_array(ctx, out, 1, alpha, beta, error);
+}
+
+/* Random doubles with exponential distribution. lambda 1.0/mean */
 void
-egads_expovariate(prngctx_t *ctx, double *out, double lambda, int *error)
+egads_expovariate_array(prngctx_t *ctx, double *out, int n, double lambda,
+                        int *error)
 {
-  double myr;
+  int i;
 
-  egads_randreal(ctx, &myr, error);
-  while (myr <= 1e-7)
+  if (array_args(ctx, out, n, error))
   {
-    egads_randreal(ctx, &myr, error);
+    return;
+  }
+  zig_exponential(ctx, out, n);
+  for (i = 0; i < n; i++)
+  {
+    out[i] /= lambda;
   }
-  *out = (double)(-log(myr) / lambda);
+}
+
+void
+egads_expovariate(prngctx_t *ctx, double *out, double lambda, int *error)
+{
+  egads_expovariate_array(ctx, out, 1, lambda, error);
 }
 
 /* Returns a range between 0 and 1. alpha > -1 and beta > -1 required */
@@ -212,16 +471,11 @@ egads_betavariate(prngctx_t *ctx, double *out, double alpha, double beta, int *e
   *out = myr2 / (myr1 + myr2);
 }
 
-/* Get a random double with condition min <= out <= max */ 
+/* Get a random double with condition min <= out < max */ 
 void
 egads_randuniform(prngctx_t *ctx, double *out, double min, double max, int *error)
 {
-  double myr;
-
-  egads_randreal(ctx, &myr, error); 
-  *out = min + (max - min) * myr;
-  *error = 0;
-  return;
+  egads_randuniform_array(ctx, out, 1, min, max, error);
 }
 
 void egads_cunifvariate(prngctx_t *ctx, double *out, double mean, double arc, int *error)
@@ -232,27 +486,136 @@ void egads_cunifvariate(prngctx_t *ctx, double *out, double mean, double arc, in
   *out = (mean + arc * (myr - 0.5)) / PI;
 }
 
+/* Bounded integers use Lemire's multiply-shift method: the high word of
+   x * range maps a 32-bit x onto [0, range), and the few x whose low word
+   falls below 2^32 mod range are drawn again, which makes every result
+   exactly equally likely. Keystream is drawn RANGE_CHUNK values at a time. */
+#define RANGE_CHUNK 256
+
+static void
+randrange_fill(prngctx_t *ctx, int *out, int n, int min, int max)
+{
+  unsigned int buf[RANGE_CHUNK], range, thresh, x;
+  uint64 m = 0;
+  int i, want, pos = 0, avail = 0, used = 0;
+
+  /* A range of 0 stands for all 2^32 values */
+  range = (unsigned int)max - (unsigned int)min + 1;
+  thresh = (range ? (0U - range) % range : 0);
+
+  for (i = 0; i < n; i++)
+  {
+    do
+    {
+      if (pos == avail)
+      {
+        want = (n - i < RANGE_CHUNK ? n - i : RANGE_CHUNK);
+        PRNG_output_cached(ctx, (char *)buf, want * sizeof(unsigned int));
+        avail = want;
+        pos = 0;
+        if (want > used)
+        {
+          used = want;
+        }
+      }
+      x = buf[pos++];
+      m = (uint64)x * range;
+    } while ((unsigned int)m < thresh);
+
+    out[i] = (int)((unsigned int)min + (range ? (unsigned int)(m >> 32) : x));
+  }
+  memset(buf, 0, used * sizeof(unsigned int));
+}
+
+/* Fill out with n integers in [min,max], each exactly uniform */
+void
+egads_randrange_array(prngctx_t *ctx, int *out, int n, int min, int max,
+                      int *error)
+{
+  *error = 0;
+  if (ctx == NULL)
+  {
+    *error = RERR_NOHANDLE;
+    return;
+  }
+  if (n < 0 || min > max || (n > 0 && out == NULL))
+  {
+    *error = RERR_BADARGS;
+    return;
+  }
+  randrange_fill(ctx, out, n, min, max);
+}
+
 /* Return an integer in [min,max]. min can be negative */
 void
 egads_randrange(prngctx_t * ctx, int *out, int min, int max, int *error)
 {
-  unsigned int rado = 0;
+  egads_randrange_array(ctx, out, 1, min, max, error);
+}
+
+/* Shuffling and sampling need one bounded integer per step, each with a
+   different bound. They come from 32-bit words of keystream drawn in
+   batches of RANGE_CHUNK, with the multiply-shift of randrange_fill; the
+   rejection threshold needs a division, so it is only worked out in the
+   rare case that a word could be rejected at all. */
+typedef struct
+{
+  prngctx_t *ctx;
+  unsigned int buf[RANGE_CHUNK];
+  int pos, avail, used;
+} index_src_t;
 
-  do { 
-    egads_randint(ctx, &rado, error);
-    /* Throw out rado == UINT_MAX */
-  } while(!(~(rado & ~(unsigned int)0)));
-  *out = (int)(min + (double)rado *(max - min + 1) / UINT_MAX);
+/* An integer in [0, range), range > 0. want is how many more the caller
+   expects to draw, and sizes the next request for keystream. */
+static unsigned int
+index_draw(index_src_t *src, unsigned int range, int want)
+{
+  unsigned int thresh = 0;
+  uint64 m;
+
+  for (;;)
+  {
+    if (src->pos == src->avail)
+    {
+      if (want > RANGE_CHUNK)
+      {
+        want = RANGE_CHUNK;
+      }
+      PRNG_output_cached(src->ctx, (char *)src->buf,
+                         want * sizeof(unsigned int));
+      src->avail = want;
+      src->pos = 0;
+      if (want > src->used)
+      {
+        src->used = want;
+      }
+    }
+    m = (uint64)src->buf[src->pos++] * range;
+    /* The threshold is below range, so no other word can be rejected */
+    if ((unsigned int)m < range)
+    {
+      if (thresh == 0)
+      {
+        thresh = (0U - range) % range;
+      }
+      if ((unsigned int)m < thresh)
+      {
+        continue;
+      }
+    }
+    return (unsigned int)(m >> 32);
+  }
 }
 
-/* Generate a random string that can contain any printable character.
-   (ASCII 33 through 126) out must be len+1 bytes long, in order to accomodate
-   the terminating zero. Caller is responsible for allocating the buffer.
-*/
+/* Put the nmemb elements of size bytes at base in random order, every
+   order being equally likely (Fisher-Yates) */
 void
-egads_randstring(prngctx_t * ctx, char *out, int len, int *error)
+egads_shuffle(prngctx_t *ctx, void *base, int nmemb, int size, int *error)
 {
-  int i, tmp;
+  index_src_t src;
+  unsigned int j;
+  char tmp[64], *a, *b;
+  int i, k;
 
   *error = 0;
   if (ctx == NULL)
@@ -260,17 +623,359 @@ egads_randstring(prngctx_t * ctx, char *out, int len, int *error)
     *error = RERR_NOHANDLE;
     return;
   }
+  if (nmemb < 0 || size < 1 || (nmemb > 1 && base == NULL))
+  {
+    *error = RERR_BADARGS;
+    return;
+  }
 
-  for (i = 0; i < len; i++)
+  src.ctx = ctx;
+  src.pos = src.avail = src.used = 0;
+  for (i = nmemb - 1; i > 0; i--)
+  {
+    j = index_draw(&src, (unsigned int)i + 1, i);
+    if (j == (unsigned int)i)
+    {
+      continue;
+    }
+    a = (char *)base + (size_t)i * size;
+    b = (char *)base + (size_t)j * size;
+    /* The usual element sizes get a swap the compiler can inline */
+    if (size == sizeof(unsigned int))
+    {
+      unsigned int t;
+
+      memcpy(&t, a, sizeof(t));
+      memcpy(a, b, sizeof(t));
+      memcpy(b, &t, sizeof(t));
+    }
+    else if (size == sizeof(uint64))
+    {
+      uint64 t;
+
+      memcpy(&t, a, sizeof(t));
+      memcpy(a, b, sizeof(t));
+      memcpy(b, &t, sizeof(t));
+    }
+    else
+    {
+      for (k = 0; k < size; k += sizeof(tmp))
+      {
+        int len = (size - k < (int)sizeof(tmp) ? size - k : (int)sizeof(tmp));
+
+        memcpy(tmp, a + k, len);
+        memcpy(a + k, b + k, len);
+        memcpy(b + k, tmp, len);
+      }
+    }
+  }
+  memset(src.buf, 0, src.used * sizeof(unsigned int));
+}
+
+/* Fill out with k distinct integers from [0, n), every subset being
+   equally likely. Floyd's algorithm takes one bounded integer per value
+   and a hash set of the values chosen so far, so the cost depends on k
+   alone; the values are left in the order they were chosen, which is not
+   random. */
+#define SAMPLE_HASH(v)  (((v) * 2654435769U) >> (32 - bits))
+
+void
+egads_sample(prngctx_t *ctx, int n, int k, int *out, int *error)
+{
+  index_src_t src;
+  unsigned int *set, t, h, mask;
+  int i, j, bits;
+
+  *error = 0;
+  if (ctx == NULL)
+  {
+    *error = RERR_NOHANDLE;
+    return;
+  }
+  if (n < 0 || k < 0 || k > n || (k > 0 && out == NULL))
+  {
+    *error = RERR_BADARGS;
+    return;
+  }
+  if (k == 0)
+  {
+    return;
+  }
+
+  /* Open addressing at most half full, holding value + 1 so 0 is free */
+  for (bits = 1; bits < 31 && (1U << bits) < 2U * (unsigned int)k; bits++)
+    ;
+  mask = (1U << bits) - 1;
+  if ((set = (unsigned int *)calloc(mask + 1, sizeof(unsigned int))) == NULL)
+  {
+    *error = RERR_NOMEM;
+    return;
+  }
+
+  src.ctx = ctx;
+  src.pos = src.avail = src.used = 0;
+  for (i = 0, j = n - k; j < n; i++, j++)
+  {
+    t = index_draw(&src, (unsigned int)j + 1, k - i);
+    for (h = SAMPLE_HASH(t); set[h] && set[h] != t + 1; h = (h + 1) & mask)
+      ;
+    /* If t was taken already, take j instead, which cannot have been */
+    if (set[h])
+    {
+      t = (unsigned int)j;
+      for (h = SAMPLE_HASH(t); set[h]; h = (h + 1) & mask)
+        ;
+    }
+    set[h] = t + 1;
+    out[i] = (int)t;
+  }
+  free(set);
+  memset(src.buf, 0, src.used * sizeof(unsigned int));
+}
+
+/* Weighted choice uses Walker's alias method, with the table built by Vose's
+   numerically stable construction. Column i keeps outcome i with chance
+   prob / 2^32 and gives its alias otherwise, so a draw costs one bounded
+   integer and one comparison, and touches one cache line of the table.
+   Both come out of a single 64-bit word: the high half picks the column as
+   in randrange_fill, the low half is the coin. */
+#define DISCRETE_CHUNK 128
+
+void
+egads_discrete_init(egads_discrete_t *d, const double *weights, int n,
+                    int *error)
+{
+  double sum = 0, x, *p;
+  int *work;
+  int i, s, l, nsmall = 0, nlarge = 0;
+
+  *error = 0;
+  if (d == NULL)
+  {
+    *error = RERR_BADARGS;
+    return;
+  }
+  memset(d, 0, sizeof(egads_discrete_t));
+  if (weights == NULL || n < 1)
+  {
+    *error = RERR_BADARGS;
+    return;
+  }
+  for (i = 0; i < n; i++)
+  {
+    /* Also rejects NaN */
+    if (!(weights[i] >= 0 && weights[i] <= DBL_MAX))
+    {
+      *error = RERR_BADARGS;
+      return;
+    }
+    sum += weights[i];
+  }
+  if (!(sum > 0 && sum <= DBL_MAX))
+  {
+    *error = RERR_BADARGS;
+    return;
+  }
+
+  d->cols = (egads_alias_t *)malloc(n * sizeof(egads_alias_t));
+  p = (double *)malloc(n * sizeof(double));
+  work = (int *)malloc(n * sizeof(int));
+  if (d->cols == NULL || p == NULL || work == NULL)
+  {
+    free(d->cols);
+    free(p);
+    free(work);
+    d->cols = NULL;
+    *error = RERR_NOMEM;
+    return;
+  }
+
+  /* Scale the weights to average 1. Columns below 1 are pushed on a stack
+     growing up from the start of work, the rest on one growing down from
+     the end; together they never hold more than n entries. */
+  for (i = 0; i < n; i++)
+  {
+    p[i] = weights[i] / sum * n;
+    if (p[i] < 1.0)
+    {
+      work[nsmall++] = i;
+    }
+    else
+    {
+      work[n - ++nlarge] = i;
+    }
+  }
+
+  /* Top up each small column from a large one */
+  while (nsmall && nlarge)
+  {
+    s = work[--nsmall];
+    l = work[n - nlarge];
+    x = p[s] * 4294967296.0 + 0.5;
+    d->cols[s].prob = (x < 4294967295.0 ? (unsigned int)x : 0xffffffffU);
+    d->cols[s].alias = l;
+    p[l] = (p[l] + p[s]) - 1.0;
+    if (p[l] < 1.0)
+    {
+      nlarge--;
+      work[nsmall++] = l;
+    }
+  }
+
+  /* What is left is full to within rounding error. Such a column gives
+     its own outcome whichever way the coin falls. */
+  while (nsmall)
+  {
+    s = work[--nsmall];
+    d->cols[s].prob = 0xffffffffU;
+    d->cols[s].alias = s;
+  }
+  while (nlarge)
+  {
+    l = work[n - nlarge--];
+    d->cols[l].prob = 0xffffffffU;
+    d->cols[l].alias = l;
+  }
+
+  d->n = n;
+  d->thresh = (0U - (unsigned int)n) % (unsigned int)n;
+  free(p);
+  free(work);
+}
+
+void
+egads_discrete_destroy(egads_discrete_t *d)
+{
+  if (d == NULL)
   {
-    egads_randrange(ctx, &tmp, 33, 126, error);
-    if (*error)
+    return;
+  }
+  free(d->cols);
+  memset(d, 0, sizeof(egads_discrete_t));
+}
+
+/* Fill out with n outcomes drawn from the table d */
+void
+egads_discrete_array(prngctx_t *ctx, egads_discrete_t *d, int *out, int n,
+                     int *error)
+{
+  uint64 buf[DISCRETE_CHUNK], w, m = 0;
+  egads_alias_t *col;
+  int i, want, pos = 0, avail = 0, used = 0;
+
+  *error = 0;
+  if (ctx == NULL)
+  {
+    *error = RERR_NOHANDLE;
+    return;
+  }
+  if (d == NULL || d->n < 1 || n < 0 || (n > 0 && out == NULL))
+  {
+    *error = RERR_BADARGS;
+    return;
+  }
+
+  for (i = 0; i < n; i++)
+  {
+    do
+    {
+      if (pos == avail)
+      {
+        want = (n - i < DISCRETE_CHUNK ? n - i : DISCRETE_CHUNK);
+        PRNG_output_cached(ctx, (char *)buf, want * sizeof(uint64));
+        avail = want;
+        pos = 0;
+        if (want > used)
+        {
+          used = want;
+        }
+      }
+      w = buf[pos++];
+      m = (w >> 32) * (unsigned int)d->n;
+    } while ((unsigned int)m < d->thresh);
+
+    col = &(d->cols[m >> 32]);
+    out[i] = ((unsigned int)w < col->prob ? (int)(m >> 32) : col->alias);
+  }
+  memset(buf, 0, used * sizeof(uint64));
+}
+
+void
+egads_discrete(prngctx_t *ctx, egads_discrete_t *d, int *out, int *error)
+{
+  egads_discrete_array(ctx, d, out, 1, error);
+}
+
+/* Fill out with len characters, each drawn uniformly from the alen
+   characters of alphabet. Every byte of keystream becomes a character with
+   the multiply-shift rejection of egads_randrange_array, on 8 bits, so
+   (256 mod alen) bytes in 256 are thrown away. No terminating
+   zero is added. */
+#define ALPHABET_CHUNK 256
+
+void
+egads_randalphabet(prngctx_t *ctx, char *out, int len, const char *alphabet,
+                   int alen, int *error)
+{
+  unsigned char buf[ALPHABET_CHUNK];
+  unsigned int m, thresh;
+  int i, want, pos = 0, avail = 0, used = 0;
+
+  *error = 0;
+  if (ctx == NULL)
+  {
+    *error = RERR_NOHANDLE;
+    return;
+  }
+  if (len < 0 || alen < 1 || alen > 256 || alphabet == NULL
+      || (len > 0 && out == NULL))
+  {
+    *error = RERR_BADARGS;
+    return;
+  }
+
+  thresh = 256 % alen;
+  for (i = 0; i < len; )
+  {
+    if (pos == avail)
     {
-      break;
+      /* Ask for enough to cover the expected rejections as well, so that
+         a short string rarely needs a second request */
+      want = (len - i < ALPHABET_CHUNK ? len - i : ALPHABET_CHUNK);
+      want = want * 256 / (256 - thresh) + (thresh ? 8 : 0);
+      if (want > ALPHABET_CHUNK)
+      {
+        want = ALPHABET_CHUNK;
+      }
+      PRNG_output_cached(ctx, (char *)buf, want);
+      avail = want;
+      pos = 0;
+      if (want > used)
+      {
+        used = want;
+      }
     }
-    out[i] = (char)tmp;
+    /* Always store, and only move on if the byte was accepted; rejections
+       are too frequent with some alphabets to spend a branch on */
+    m = buf[pos++] * (unsigned int)alen;
+    out[i] = alphabet[m >> 8];
+    i += ((m & 0xff) >= thresh);
+  }
+  memset(buf, 0, used);
+}
+
+/* Generate a random string that can contain any printable character.
+   (ASCII 33 through 126) out must be len+1 bytes long, in order to accomodate
+   the terminating zero. Caller is responsible for allocating the buffer.
+*/
+void
+egads_randstring(prngctx_t * ctx, char *out, int len, int *error)
+{
+  egads_randalphabet(ctx, out, len, printable, sizeof(printable) - 1, error);
+  if (*error == 0 && len > 0)
+  {
+    out[len - 1] = 0;
   }
-  out[len - 1] = 0;
 }
 
 /* Generate a random string in the range [a-zA-Z0-9] (safe bet for valid 
@@ -281,7 +986,138 @@ egads_randstring(prngctx_t * ctx, char *out, int len, int *error)
 void
 egads_randfname(prngctx_t * ctx, char *out, int len, int *error)
 {
-  int i, tmp;
+  egads_randalphabet(ctx, out, len, fnametable, sizeof(fnametable) - 1,
+                     error);
+  if (*error == 0 && len > 0)
+  {
+    out[len - 1] = 0;
+  }
+}
+
+/* UUIDs and tokens format keystream drawn TOKEN_CHUNK bytes at a time. The
+   chunk is a multiple of 3, so a long token split over several chunks
+   still falls on base64 group boundaries, and of 16, the size of a UUID. */
+#define TOKEN_CHUNK 3072
+
+/* Two hex digits for every byte value */
+static const char hexpairs[] =
+  "000102030405060708090a0b0c0d0e0f"
+  "101112131415161718191a1b1c1d1e1f"
+  "202122232425262728292a2b2c2d2e2f"
+  "303132333435363738393a3b3c3d3e3f"
+  "404142434445464748494a4b4c4d4e4f"
+  "505152535455565758595a5b5c5d5e5f"
+  "606162636465666768696a6b6c6d6e6f"
+  "707172737475767778797a7b7c7d7e7f"
+  "808182838485868788898a8b8c8d8e8f"
+  "909192939495969798999a9b9c9d9e9f"
+  "a0a1a2a3a4a5a6a7a8a9aaabacadaeaf"
+  "b0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+  "c0c1c2c3c4c5c6c7c8c9cacbcccdcecf"
+  "d0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+  "e0e1e2e3e4e5e6e7e8e9eaebecedeeef"
+  "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+static const char b64url[] =
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+static void
+encode_hex(const unsigned char *in, int len, char *out)
+{
+  int i;
+
+  for (i = 0; i < len; i++)
+  {
+    memcpy(&out[2 * i], &hexpairs[2 * in[i]], 2);
+  }
+}
+
+/* Unpadded base64url, RFC 4648 section 5 */
+static void
+encode_b64url(const unsigned char *in, int len, char *out)
+{
+  unsigned int v;
+  int i;
+
+  for (i = 0; i + 3 <= len; i += 3, out += 4)
+  {
+    v = ((unsigned int)in[i] << 16) | ((unsigned int)in[i + 1] << 8) | in[i + 2];
+    out[0] = b64url[v >> 18];
+    out[1] = b64url[(v >> 12) & 0x3f];
+    out[2] = b64url[(v >> 6) & 0x3f];
+    out[3] = b64url[v & 0x3f];
+  }
+  if (len - i == 1)
+  {
+    v = (unsigned int)in[i] << 16;
+    out[0] = b64url[v >> 18];
+    out[1] = b64url[(v >> 12) & 0x3f];
+  }
+  else if (len - i == 2)
+  {
+    v = ((unsigned int)in[i] << 16) | ((unsigned int)in[i + 1] << 8);
+    out[0] = b64url[v >> 18];
+    out[1] = b64url[(v >> 12) & 0x3f];
+    out[2] = b64url[(v >> 6) & 0x3f];
+  }
+}
+
+/* Write n random (version 4) UUIDs to out, each as 36 characters and a
+   null, so out must hold n * EGADS_UUID_LEN bytes */
+void
+egads_uuid4_array(prngctx_t *ctx, char *out, int n, int *error)
+{
+  unsigned char buf[TOKEN_CHUNK], *u;
+  int i, j, m, used = 0;
+
+  *error = 0;
+  if (ctx == NULL)
+  {
+    *error = RERR_NOHANDLE;
+    return;
+  }
+  if (n < 0 || (n > 0 && out == NULL))
+  {
+    *error = RERR_BADARGS;
+    return;
+  }
+
+  for (i = 0; i < n; i += m)
+  {
+    m = (n - i < TOKEN_CHUNK / 16 ? n - i : TOKEN_CHUNK / 16);
+    PRNG_output_cached(ctx, (char *)buf, m * 16);
+    if (m * 16 > used)
+    {
+      used = m * 16;
+    }
+    for (j = 0; j < m; j++, out += EGADS_UUID_LEN)
+    {
+      u = &buf[j * 16];
+      u[6] = (u[6] & 0x0f) | 0x40;    /* Version 4 */
+      u[8] = (u[8] & 0x3f) | 0x80;    /* RFC 4122 variant */
+      encode_hex(u, 4, out);
+      out[8] = '-';
+      encode_hex(u + 4, 2, out + 9);
+      out[13] = '-';
+      encode_hex(u + 6, 2, out + 14);
+      out[18] = '-';
+      encode_hex(u + 8, 2, out + 19);
+      out[23] = '-';
+      encode_hex(u + 10, 6, out + 24);
+      out[36] = 0;
+    }
+  }
+  memset(buf, 0, used);
+}
+
+/* Write n tokens of bytes random bytes each to out, encoded as hex or
+   base64url and null terminated. Token i starts at
+   out + i * EGADS_TOKEN_LEN(bytes, encoding). */
+void
+egads_token_array(prngctx_t *ctx, char *out, int n, int bytes, int encoding,
+                  int *error)
+{
+  unsigned char buf[TOKEN_CHUNK];
+  int i, j, m, len, off, stride, used = 0;
 
   *error = 0;
   if (ctx == NULL)
@@ -289,15 +1125,64 @@ egads_randfname(prngctx_t * ctx, char *out, int len, int *error)
     *error = RERR_NOHANDLE;
     return;
   }
+  if (n < 0 || bytes < 1 || (n > 0 && out == NULL)
+      || (encoding != EGADS_TOKEN_HEX && encoding != EGADS_TOKEN_BASE64URL))
+  {
+    *error = RERR_BADARGS;
+    return;
+  }
 
-  for (i = 0; i < len; i++)
+  stride = EGADS_TOKEN_LEN(bytes, encoding);
+  if (bytes <= TOKEN_CHUNK)
+  {
+    /* As many whole tokens per fetch as fit */
+    for (i = 0; i < n; i += m)
+    {
+      m = TOKEN_CHUNK / bytes;
+      if (m > n - i)
+      {
+        m = n - i;
+      }
+      PRNG_output_cached(ctx, (char *)buf, m * bytes);
+      if (m * bytes > used)
+      {
+        used = m * bytes;
+      }
+      for (j = 0; j < m; j++, out += stride)
+      {
+        if (encoding == EGADS_TOKEN_HEX)
+        {
+          encode_hex(&buf[j * bytes], bytes, out);
+        }
+        else
+        {
+          encode_b64url(&buf[j * bytes], bytes, out);
+        }
+        out[stride - 1] = 0;
+      }
+    }
+  }
+  else
   {
-    egads_randrange(ctx, &tmp, 0, strlen(fnametable) - 1, error);
-    if (*error)
+    /* Long tokens take several fetches each */
+    used = TOKEN_CHUNK;
+    for (i = 0; i < n; i++, out += stride)
     {
-      break;
+      for (off = 0; off < bytes; off += len)
+      {
+        len = (bytes - off < TOKEN_CHUNK ? bytes - off : TOKEN_CHUNK);
+        PRNG_output_cached(ctx, (char *)buf, len);
+        if (encoding == EGADS_TOKEN_HEX)
+        {
+          encode_hex(buf, len, out + 2 * off);
+        }
+        else
+        {
+          encode_b64url(buf, len, out + off / 3 * 4);
+        }
+      }
+      out[stride - 1] = 0;
     }
-    out[i] = fnametable[tmp];
   }
-  out[len - 1] = 0;
+  memset(buf, 0, used);
 }
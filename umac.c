@@ -91,6 +91,17 @@ typedef UINT32  LARGE_UWORD;
 #define MSC_X86         (_MSC_VER && _M_IX86)       /* Microsoft on IA-32 */
 #define MW_PPC          ((__MWERKS__ || __MRC__) && __POWERPC__)
                                                     /* Metrowerks on PPC  */
+
+/* The AES-NI block cipher is selected at run time, so it is independent of
+ * the USE_C_ONLY switch above. It needs a compiler that understands the
+ * per-function target attribute (gcc 4.9, clang 3.8 and later).
+ */
+#if ((__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9) || __clang__) \
+     && (__x86_64__ || __i386__) && UMAC_KEY_LEN == 16)
+#define GCC_AESNI       1                           /* AES-NI on x86      */
+#else
+#define GCC_AESNI       0
+#endif
 /* ---------------------------------------------------------------------- */
 /* --- Host Computer Endian Definition ---------------------------------- */
 /* ---------------------------------------------------------------------- */
@@ -574,7 +585,7 @@ UINT32 rcon[30] = {
 
 #define KC				(UMAC_KEY_LEN / 4)
 
-int aes_setup(UINT8 key[UMAC_KEY_LEN], aes_int_key W) {
+static int aes_setup_table(UINT8 key[UMAC_KEY_LEN], aes_int_key W) {
 	/* Calculate the necessary round keys
 	 * The number of calculations depends on keyBits and blockBits
 	 */ 
@@ -639,7 +650,7 @@ int aes_setup(UINT8 key[UMAC_KEY_LEN], aes_int_key W) {
 /**
  * Encrypt a single block. 
  */
-int aes(UINT8 a[16], UINT8 b[16], aes_int_key rk) {
+static int aes_table(UINT8 a[16], UINT8 b[16], aes_int_key rk) {
 	int r;
 	UINT8 temp[4][4];
 
@@ -715,6 +726,212 @@ int aes(UINT8 a[16], UINT8 b[16], aes_int_key rk) {
 	return 0;
 }
 
+/* ---------------------------------------------------------------------- */
+/* --- AES-NI block cipher ---------------------------------------------- */
+/* ---------------------------------------------------------------------- */
+
+/* The table code above stores round key r as the 16 bytes W[r][0..3][0..3],
+ * which is exactly the byte order the AES-NI instructions expect. Both
+ * backends therefore share the aes_int_key layout, and a key scheduled by
+ * one may be used to encrypt with the other.
+ */
+
+#if (GCC_AESNI)
+
+#include <cpuid.h>
+#include <wmmintrin.h>
+
+#define AESNI_TARGET __attribute__((target("aes,sse2")))
+
+#define AESNI_EXPAND(k, rc) \
+    t = _mm_shuffle_epi32(_mm_aeskeygenassist_si128((k), (rc)), 0xff); \
+    (k) = _mm_xor_si128((k), _mm_slli_si128((k), 4));                  \
+    (k) = _mm_xor_si128((k), _mm_slli_si128((k), 4));                  \
+    (k) = _mm_xor_si128((k), _mm_slli_si128((k), 4));                  \
+    (k) = _mm_xor_si128((k), t)
+
+AESNI_TARGET
+static int aes_setup_aesni(UINT8 key[UMAC_KEY_LEN], aes_int_key W) {
+	__m128i k, t;
+
+	k = _mm_loadu_si128((__m128i *)key);
+	_mm_storeu_si128((__m128i *)W[0], k);
+	AESNI_EXPAND(k, 0x01); _mm_storeu_si128((__m128i *)W[1], k);
+	AESNI_EXPAND(k, 0x02); _mm_storeu_si128((__m128i *)W[2], k);
+	AESNI_EXPAND(k, 0x04); _mm_storeu_si128((__m128i *)W[3], k);
+	AESNI_EXPAND(k, 0x08); _mm_storeu_si128((__m128i *)W[4], k);
+	AESNI_EXPAND(k, 0x10); _mm_storeu_si128((__m128i *)W[5], k);
+	AESNI_EXPAND(k, 0x20); _mm_storeu_si128((__m128i *)W[6], k);
+	AESNI_EXPAND(k, 0x40); _mm_storeu_si128((__m128i *)W[7], k);
+	AESNI_EXPAND(k, 0x80); _mm_storeu_si128((__m128i *)W[8], k);
+	AESNI_EXPAND(k, 0x1b); _mm_storeu_si128((__m128i *)W[9], k);
+	AESNI_EXPAND(k, 0x36); _mm_storeu_si128((__m128i *)W[10], k);
+	return 0;
+}
+
+AESNI_TARGET
+static int aes_aesni(UINT8 a[16], UINT8 b[16], aes_int_key rk) {
+	__m128i m;
+	int r;
+
+	m = _mm_xor_si128(_mm_loadu_si128((__m128i *)a),
+	                  _mm_loadu_si128((__m128i *)rk[0]));
+	for (r = 1; r < ROUNDS; r++) {
+		m = _mm_aesenc_si128(m, _mm_loadu_si128((__m128i *)rk[r]));
+	}
+	m = _mm_aesenclast_si128(m, _mm_loadu_si128((__m128i *)rk[ROUNDS]));
+	_mm_storeu_si128((__m128i *)b, m);
+	return 0;
+}
+
+/* Eight independent blocks are kept in flight so that the latency of each
+ * aesenc is hidden behind the other seven.
+ */
+AESNI_TARGET
+static int aes_blocks_aesni(UINT8 *in, UINT8 *out, int nblocks,
+                            aes_int_key rk) {
+	__m128i k, m0, m1, m2, m3, m4, m5, m6, m7;
+	int r;
+
+	for (; nblocks >= 8; nblocks -= 8, in += 128, out += 128) {
+		k  = _mm_loadu_si128((__m128i *)rk[0]);
+		m0 = _mm_xor_si128(_mm_loadu_si128((__m128i *)(in      )), k);
+		m1 = _mm_xor_si128(_mm_loadu_si128((__m128i *)(in +  16)), k);
+		m2 = _mm_xor_si128(_mm_loadu_si128((__m128i *)(in +  32)), k);
+		m3 = _mm_xor_si128(_mm_loadu_si128((__m128i *)(in +  48)), k);
+		m4 = _mm_xor_si128(_mm_loadu_si128((__m128i *)(in +  64)), k);
+		m5 = _mm_xor_si128(_mm_loadu_si128((__m128i *)(in +  80)), k);
+		m6 = _mm_xor_si128(_mm_loadu_si128((__m128i *)(in +  96)), k);
+		m7 = _mm_xor_si128(_mm_loadu_si128((__m128i *)(in + 112)), k);
+		for (r = 1; r < ROUNDS; r++) {
+			k  = _mm_loadu_si128((__m128i *)rk[r]);
+			m0 = _mm_aesenc_si128(m0, k);
+			m1 = _mm_aesenc_si128(m1, k);
+			m2 = _mm_aesenc_si128(m2, k);
+			m3 = _mm_aesenc_si128(m3, k);
+			m4 = _mm_aesenc_si128(m4, k);
+			m5 = _mm_aesenc_si128(m5, k);
+			m6 = _mm_aesenc_si128(m6, k);
+			m7 = _mm_aesenc_si128(m7, k);
+		}
+		k = _mm_loadu_si128((__m128i *)rk[ROUNDS]);
+		_mm_storeu_si128((__m128i *)(out      ), _mm_aesenclast_si128(m0, k));
+		_mm_storeu_si128((__m128i *)(out +  16), _mm_aesenclast_si128(m1, k));
+		_mm_storeu_si128((__m128i *)(out +  32), _mm_aesenclast_si128(m2, k));
+		_mm_storeu_si128((__m128i *)(out +  48), _mm_aesenclast_si128(m3, k));
+		_mm_storeu_si128((__m128i *)(out +  64), _mm_aesenclast_si128(m4, k));
+		_mm_storeu_si128((__m128i *)(out +  80), _mm_aesenclast_si128(m5, k));
+		_mm_storeu_si128((__m128i *)(out +  96), _mm_aesenclast_si128(m6, k));
+		_mm_storeu_si128((__m128i *)(out + 112), _mm_aesenclast_si128(m7, k));
+	}
+	for (; nblocks > 0; nblocks--, in += 16, out += 16) {
+		aes_aesni(in, out, rk);
+	}
+	return 0;
+}
+
+static int aesni_supported(void) {
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return 0;
+	return (ecx & bit_AES) && (edx & bit_SSE2);
+}
+
+#endif /* GCC_AESNI */
+
+/* ---------------------------------------------------------------------- */
+/* --- Block cipher dispatch -------------------------------------------- */
+/* ---------------------------------------------------------------------- */
+
+/* The first call through either pointer probes the CPU and installs the
+ * best backend. Concurrent first calls all compute the same answer, so the
+ * unsynchronized store is harmless.
+ */
+
+/* The table code stores whole 32-bit words, so output that is not suitably
+ * aligned for that is produced in a scratch block and copied out.
+ */
+static int aes_blocks_table(UINT8 *in, UINT8 *out, int nblocks,
+                            aes_int_key rk) {
+	UINT8 tmp[AES_BLOCK_LEN];
+
+	for (; nblocks > 0; nblocks--, in += 16, out += 16) {
+		if (((UWORD)out & (sizeof(UINT32) - 1)) == 0) {
+			aes_table(in, out, rk);
+		} else {
+			aes_table(in, tmp, rk);
+			memcpy(out, tmp, AES_BLOCK_LEN);
+		}
+	}
+	return 0;
+}
+
+static int aes_setup_probe(UINT8 key[UMAC_KEY_LEN], aes_int_key W);
+static int aes_probe(UINT8 a[16], UINT8 b[16], aes_int_key rk);
+static int aes_blocks_probe(UINT8 *in, UINT8 *out, int nblocks,
+                            aes_int_key rk);
+
+static int (*aes_setup_impl)(UINT8 *, aes_int_key) = aes_setup_probe;
+static int (*aes_impl)(UINT8 *, UINT8 *, aes_int_key) = aes_probe;
+static int (*aes_blocks_impl)(UINT8 *, UINT8 *, int, aes_int_key) =
+	aes_blocks_probe;
+
+int aes_set_backend(int backend) {
+#if (GCC_AESNI)
+	if (backend == AES_BACKEND_AUTO)
+		backend = aesni_supported() ? AES_BACKEND_AESNI : AES_BACKEND_TABLE;
+	if (backend == AES_BACKEND_AESNI && aesni_supported()) {
+		aes_setup_impl = aes_setup_aesni;
+		aes_impl = aes_aesni;
+		aes_blocks_impl = aes_blocks_aesni;
+		return AES_BACKEND_AESNI;
+	}
+#endif
+	aes_setup_impl = aes_setup_table;
+	aes_impl = aes_table;
+	aes_blocks_impl = aes_blocks_table;
+	return AES_BACKEND_TABLE;
+}
+
+int aes_get_backend(void) {
+	if (aes_impl == aes_probe)
+		aes_set_backend(AES_BACKEND_AUTO);
+#if (GCC_AESNI)
+	if (aes_impl == aes_aesni)
+		return AES_BACKEND_AESNI;
+#endif
+	return AES_BACKEND_TABLE;
+}
+
+static int aes_setup_probe(UINT8 key[UMAC_KEY_LEN], aes_int_key W) {
+	aes_set_backend(AES_BACKEND_AUTO);
+	return aes_setup_impl(key, W);
+}
+
+static int aes_probe(UINT8 a[16], UINT8 b[16], aes_int_key rk) {
+	aes_set_backend(AES_BACKEND_AUTO);
+	return aes_impl(a, b, rk);
+}
+
+static int aes_blocks_probe(UINT8 *in, UINT8 *out, int nblocks,
+                            aes_int_key rk) {
+	aes_set_backend(AES_BACKEND_AUTO);
+	return aes_blocks_impl(in, out, nblocks, rk);
+}
+
+int aes_setup(UINT8 key[UMAC_KEY_LEN], aes_int_key W) {
+	return aes_setup_impl(key, W);
+}
+
+int aes(UINT8 a[16], UINT8 b[16], aes_int_key rk) {
+	return aes_impl(a, b, rk);
+}
+
+int aes_blocks(UINT8 *in, UINT8 *out, int nblocks, aes_int_key rk) {
+	return aes_blocks_impl(in, out, nblocks, rk);
+}
+
 /* ---------------------------------------------------------------------- */
 /* ---------------------------------------------------------------------- */
 /* ----- Begin KDF & PDF Section ---------------------------------------- */
@@ -172,6 +172,25 @@ int uhash(uhash_ctx_t ctx,
 int aes(UINT8 a[16], UINT8 b[16], aes_int_key rk);
 int aes_setup(UINT8 key[UMAC_KEY_LEN], aes_int_key W);
 
+int aes_blocks(UINT8 *in, UINT8 *out, int nblocks, aes_int_key rk);
+/* Encrypt nblocks consecutive, independent blocks from in to out. The
+ * buffers need no particular alignment but must not partially overlap.
+ */
+
+#define AES_BACKEND_AUTO      0   /* Best backend the CPU supports         */
+#define AES_BACKEND_TABLE     1   /* Portable table driven implementation  */
+#define AES_BACKEND_AESNI     2   /* x86 AES-NI instructions               */
+
+int aes_set_backend(int backend);
+/* Select the implementation used by aes() and aes_setup(). Both backends
+ * produce identical output, so this only matters for testing and
+ * benchmarking. Returns the backend actually installed; requesting an
+ * unsupported one installs the table code.
+ */
+
+int aes_get_backend(void);
+/* Return the backend currently used by aes() and aes_setup() */
+
 #ifdef __cplusplus
     }
 #endif
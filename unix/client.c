@@ -1,39 +1,36 @@
 #include "platform.h"
 
 static
-char *devrandom_fallback(int howmuch, eg_t* ctx)
+int devrandom_fallback(char *buf, int howmuch, eg_t* ctx)
 {
   int fd, nb;
-  char *path, *outbuf;
+  char *path;
 
   printf("DEVRANDOM FALLBACK\n");
   path = EGADS_STRDUP((ctx->randfile ? ctx->randfile : "/dev/random"));
 
-  if ((fd = open(path, O_RDONLY)) == -1)
+  fd = open(path, O_RDONLY);
+  EGADS_FREE(path);
+  if (fd == -1)
   {
-    EGADS_FREE(path);
-    return NULL;
+    return 0;
   }
 
-  EGADS_ALLOC(outbuf, howmuch, 0);
-  nb = EGADS_read(fd, outbuf, howmuch);
+  nb = EGADS_read(fd, buf, howmuch);
   close(fd);
 
-  if (!nb)
-  {
-    EGADS_FREE(outbuf);
-    return NULL;
-  }
-    
-  return outbuf;
+  return (nb != 0);
 }
 
 #define EGADS_SOCKET_NAME EGADSDATA "/" SOCK_FILE_NAME
 
-char *gather_entropy(int howmuch, eg_t *ctx)
+/* Read howmuch bytes of entropy from the gateway, or failing that from the
+ * fallback file, straight into buf. Returns 0 if neither could supply them.
+ */
+int fill_entropy(char *buf, int howmuch, eg_t *ctx)
 {
   int fd, nb;
-  char cmdbuf[sizeof(int) + 1], *buffer;
+  char cmdbuf[sizeof(int) + 1];
   struct sockaddr_un sa;
 
   sa.sun_family = AF_UNIX;
@@ -43,13 +40,13 @@ char *gather_entropy(int howmuch, eg_t *ctx)
 
   if ((fd = socket(PF_UNIX, SOCK_STREAM, 0)) == -1)
   {
-    return devrandom_fallback(howmuch, ctx);
+    return devrandom_fallback(buf, howmuch, ctx);
   }
 
   if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1)
   {
     close(fd);
-    return devrandom_fallback(howmuch, ctx);
+    return devrandom_fallback(buf, howmuch, ctx);
   }
 
   cmdbuf[0] = ECMD_REQ_ENTROPY;
@@ -58,17 +55,28 @@ char *gather_entropy(int howmuch, eg_t *ctx)
   if (!EGADS_write(fd, cmdbuf, sizeof(cmdbuf)))
   {
     close(fd);
-    return devrandom_fallback(howmuch, ctx);
+    return devrandom_fallback(buf, howmuch, ctx);
   }
 
-  EGADS_ALLOC(buffer, howmuch, 0);
-  nb = EGADS_read(fd, buffer, howmuch);
+  nb = EGADS_read(fd, buf, howmuch);
   close(fd);
 
   if (!nb)
+  {
+    return devrandom_fallback(buf, howmuch, ctx);
+  }
+  return 1;
+}
+
+char *gather_entropy(int howmuch, eg_t *ctx)
+{
+  char *buffer;
+
+  EGADS_ALLOC(buffer, howmuch, 0);
+  if (buffer && !fill_entropy(buffer, howmuch, ctx))
   {
     EGADS_FREE(buffer);
-    return devrandom_fallback(howmuch, ctx);
+    buffer = NULL;
   }
   return buffer;
 }
@@ -41,6 +41,8 @@
 #define TEST_FLAG(x)      (cmd_flags & (x))
 
 #define LOG_CHUNKSZ       1024
+#define SEND_CHUNKSZ      4096
+#define CMD_MIN_INTERVAL  1     /* Seconds between ps/df runs, at least */
 #define ULOG_STEP         16
 
 int id_list[NUM_SOURCES];
@@ -217,6 +219,8 @@ static
 void *collect_entropy(void *arg)
 {
   int firstpass = 1;
+  long lastcmds = 0;
+  struct timeval now;
   if (TEST_FLAG(OPT_VERBOSE))
   {
     printf("Entropy collection started.\n");
@@ -238,10 +242,18 @@ void *collect_entropy(void *arg)
     {
       truerand();
     }
-    if (!TEST_FLAG(OPT_NO_CMDS))
+    /* While refilling the loop doesn't sleep, but the commands still
+     * only run once per delay, so ps and df aren't forked back to back.
+     */
+    gettimeofday(&now, NULL);
+    if (!TEST_FLAG(OPT_NO_CMDS) &&
+        now.tv_sec - lastcmds >= (delay > CMD_MIN_INTERVAL ? delay
+                                                           : CMD_MIN_INTERVAL))
     {
       call_ps();
       call_df();
+      gettimeofday(&now, NULL);
+      lastcmds = now.tv_sec;
     }
 
     if (TEST_FLAG(OPT_VERBOSE))
@@ -254,7 +266,8 @@ void *collect_entropy(void *arg)
         EG_startup_done();
         firstpass = 0;
     }
-    if (EG_entropy_level() >= 1.0)
+    /* Idle between runs unless the reservoir needs refilling or is empty */
+    if (!EG_refill_wanted() && EG_entropy_level() >= 1.0)
     {
       sleep(delay);
     }
@@ -304,6 +317,70 @@ int write_data(int fd, void *buffer, int len)
   return 1;
 }
 
+/* Send howmuch bytes of output. They go to the socket straight from the
+ * reservoir as far as it will take them without blocking; the rest is
+ * copied out first, so a slow client never holds up the refill.
+ */
+static
+int write_entropy(int fd, int howmuch)
+{
+  char spill[SEND_CHUNKSZ];
+  eg_seg_t seg[2];
+  struct iovec iov[2];
+  struct msghdr msg;
+  unsigned int ticket;
+  int i, n, rest, sent;
+
+  while (howmuch > 0)
+  {
+    n = EG_output_claim(seg, (howmuch < SEND_CHUNKSZ ? howmuch : SEND_CHUNKSZ),
+                        1, &ticket);
+    for (i = 0;  i < 2;  i++)
+    {
+      iov[i].iov_base = seg[i].ptr;
+      iov[i].iov_len = seg[i].len;
+    }
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = (iov[1].iov_len ? 2 : 1);
+    sent = sendmsg(fd, &msg, MSG_DONTWAIT);
+    if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+                       errno == EINTR))
+    {
+      sent = 0;
+    }
+    if (sent == -1)
+    {
+      EG_output_release(ticket);
+      return 0;
+    }
+
+    for (i = rest = 0;  i < 2;  i++)
+    {
+      if ((size_t)sent >= iov[i].iov_len)
+      {
+        sent -= iov[i].iov_len;
+        continue;
+      }
+      memcpy(&spill[rest], (char *)iov[i].iov_base + sent,
+             iov[i].iov_len - sent);
+      rest += iov[i].iov_len - sent;
+      sent = 0;
+    }
+    EG_output_release(ticket);
+
+    if (!write_data(fd, spill, rest))
+    {
+      memset(spill, 0, rest);
+      return 0;
+    }
+    howmuch -= n;
+  }
+  memset(spill, 0, sizeof(spill));
+
+  return 1;
+}
+
 /* Protocol is as follows:
  * 1 byte COMMAND, which must always be CMD_REQ_ENTROPY for right now.
  * arguments, command specific.
@@ -314,8 +391,7 @@ int write_data(int fd, void *buffer, int len)
 static
 int process_egads_request(int fd, char cmd)
 {
-  int howmuch, rc;
-  char *buffer;
+  int howmuch;
 
   switch (cmd)
   {
@@ -324,16 +400,10 @@ int process_egads_request(int fd, char cmd)
       {
         break;
       }
-
-      EGADS_ALLOC(buffer, howmuch, 0);
-      EG_output(buffer, howmuch, 1);
-      rc = write_data(fd, buffer, howmuch);
-      EGADS_FREE(buffer);
-      if (!rc)
+      if (!write_entropy(fd, howmuch))
       {
         break;
       }
-      EGADS_FREE(buffer);
       return 0;
   }
 
@@ -397,7 +467,7 @@ int process_egd_request(int fd, char cmd)
       {
         break;
       }
-      if (!write_data(fd, buffer, EG_output(buffer, howmuch, 1)))
+      if (!write_entropy(fd, howmuch))
       {
         break;
       }
@@ -656,12 +726,13 @@ void *poll_logfiles(void *arg)
 static
 void display_help(char *progname)
 {
-  fprintf(stderr, "usage: %s [dhlpvCFLRSTV]\n\n", progname);
+  fprintf(stderr, "usage: %s [dhlprvCFLRSTV]\n\n", progname);
   fprintf(stderr, "-d <seconds>  Specify the delay between collections\n");
   fprintf(stderr, "-e <name>     Specify the name of a socket to use for EGD\n");
   fprintf(stderr, "-h            Display this list of options\n");
   fprintf(stderr, "-l <logfile>  Specify a log file to watch\n");
   fprintf(stderr, "-p <path>     Specify the data directory to use\n");
+  fprintf(stderr, "-r <size>[KM] Specify the size of the output reservoir\n");
   fprintf(stderr, "-v            Specify verbose mode\n");
   fprintf(stderr, "-C            Do not include external commands in gathered data\n");
   fprintf(stderr, "-F            Do not fork\n");
@@ -676,8 +747,11 @@ static
 void read_options(int argc, char **argv)
 {
   int i;
+  char *end;
+  unsigned long size;
+  int shift;
 
-  while ((i = getopt(argc, argv, "d:e:hl:p:vCFLRSTV?")) != -1)
+  while ((i = getopt(argc, argv, "d:e:hl:p:r:vCFLRSTV?")) != -1)
   {
     switch (i)
     {
@@ -710,6 +784,30 @@ void read_options(int argc, char **argv)
         data_dir = EGADS_STRDUP(optarg);
         break;
 
+      case 'r':
+        size = strtoul(optarg, &end, 10);
+        shift = 0;
+        if (*end == 'k' || *end == 'K')
+        {
+          shift = 10;
+          end++;
+        }
+        else if (*end == 'm' || *end == 'M')
+        {
+          shift = 20;
+          end++;
+        }
+        if (*end || !size || size > (EG_RESERVOIR_MAX >> shift))
+        {
+          fprintf(stderr, "Reservoir size must be from 1 to %dM bytes; it "
+                  "is raised to at least %d and rounded up to a power of "
+                  "2.\n", EG_RESERVOIR_MAX >> 20, EG_RESERVOIR_MIN);
+          exit(EINVAL);
+        }
+        size <<= shift;
+        EG_set_reservoir(size);
+        break;
+
       case 'v':
         cmd_flags |= OPT_VERBOSE;
         break;
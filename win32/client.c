@@ -1,10 +1,13 @@
 #include "../platform.h"
 
-char *
-gather_entropy(int howmuch, eg_t *ctx)
+/* Read howmuch bytes of entropy from the gateway straight into buffer.
+ * Returns 0 on failure.
+ */
+int
+fill_entropy(char *buffer, int howmuch, eg_t *ctx)
 {
   int cbTotal;
-  char name[PATH_MAX], *buffer;
+  char name[PATH_MAX];
   DWORD cbWritten, cbRead;
   HANDLE hMailslot, hReadPipe, hWritePipe;
   egads_request_t request;
@@ -14,7 +17,7 @@ gather_entropy(int howmuch, eg_t *ctx)
    */
   if (!CreatePipe(&hReadPipe, &hWritePipe, NULL, howmuch))
   {
-    return NULL;
+    return 0;
   }
 
   /* Establish a connection to the server's mailslot.  We'll use this IPC
@@ -38,7 +41,7 @@ gather_entropy(int howmuch, eg_t *ctx)
   {
     CloseHandle(hWritePipe);
     CloseHandle(hReadPipe);
-    return NULL;
+    return 0;
   }
 
   /* Build the request packet and send it ... */
@@ -52,7 +55,7 @@ gather_entropy(int howmuch, eg_t *ctx)
     CloseHandle(hMailslot);
     CloseHandle(hWritePipe);
     CloseHandle(hReadPipe);
-    return NULL;
+    return 0;
   }
 
   CloseHandle(hMailslot);
@@ -60,21 +63,33 @@ gather_entropy(int howmuch, eg_t *ctx)
   /* Now we wait for the request to be fulfilled by the server.  We'll wait
    * indefinitely, or if an error occurs we'll bail out.
    */
-  EGADS_ALLOC(buffer, howmuch, 0);
   for (cbTotal = 0;  cbTotal < howmuch;  cbTotal = cbTotal + cbRead)
   {
     if (!ReadFile(hReadPipe, buffer + cbTotal, howmuch - cbTotal, &cbRead, NULL))
     {
-      EGADS_FREE(buffer);
       CloseHandle(hWritePipe);
       CloseHandle(hReadPipe);
-      return NULL;
+      return 0;
     }
   }
 
-  /* All done.  Cleanup the pipe and return the buffer */
+  /* All done.  Cleanup the pipe */
   CloseHandle(hWritePipe);
   CloseHandle(hReadPipe);
 
+  return 1;
+}
+
+char *
+gather_entropy(int howmuch, eg_t *ctx)
+{
+  char *buffer;
+
+  EGADS_ALLOC(buffer, howmuch, 0);
+  if (buffer && !fill_entropy(buffer, howmuch, ctx))
+  {
+    EGADS_FREE(buffer);
+    buffer = NULL;
+  }
   return buffer;
 }
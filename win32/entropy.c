@@ -237,7 +237,7 @@ DWORD WINAPI EntropyThread(LPVOID lpParameter)
       done = 1;
     }
 
-    if (EG_entropy_level() >= 1.0)
+    if (!EG_refill_wanted() && EG_entropy_level() >= 1.0)
     {
       if (WaitForSingleObject(hShutdownEvent, delay * 1000) != WAIT_TIMEOUT)
       {
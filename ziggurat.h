@@ -0,0 +1,25 @@
+#ifndef _ZIGGURAT_H_
+#define _ZIGGURAT_H_ 1
+
+#include "platform.h"
+
+/* ziggurat.h: Ziggurat samplers for the normal and exponential distributions */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Fill out with n standard normal values (mean 0, variance 1) drawn from
+ * the keystream of ctx. The keystream is requested in bulk through
+ * PRNG_output_cached, so ctx is locked about once per hundred values.
+ */
+void zig_normal(prngctx_t *ctx, double *out, int n);
+
+/* As zig_normal, for the exponential distribution with mean 1 */
+void zig_exponential(prngctx_t *ctx, double *out, int n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _ZIGGURAT_H_ */